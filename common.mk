@@ -56,6 +56,7 @@ endef
 
 $(call def-if-unset,CC,gcc)
 $(call def-if-unset,LINK,$(CC))
+$(call def-if-unset,CXX,g++)
 $(call def-if-unset,AR,ar)
 ARFLAGS    := rcu
 $(call def-if-unset,RANLIB,ranlib)
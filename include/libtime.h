@@ -19,6 +19,7 @@
  *
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef __included_libtime_h
@@ -48,6 +49,68 @@ typedef enum {
  */
 extern LIBTIME_DLL_PUBLIC void libtime_init(void);
 
+/* Flags for libtime_init_flags(). */
+enum {
+	/* Always measure the CPU clock rate against the wall clock, even if the
+	 * kernel or the processor reports it.
+	 */
+	LIBTIME_INIT_CALIBRATE = (1 << 0),
+
+	/* Check a processor-reported CPU clock rate against one short
+	 * measurement, and fall back to full calibration if they disagree.
+	 */
+	LIBTIME_INIT_VERIFY = (1 << 1),
+
+	/* Load calibration results from the cache file if they were saved
+	 * earlier in this boot on the same processor, and save them there if
+	 * not. The file is $LIBTIME_CACHE if set, otherwise libtime.cache in
+	 * $XDG_RUNTIME_DIR, otherwise /tmp/libtime-<uid>.cache. Currently only
+	 * supported on Linux.
+	 */
+	LIBTIME_INIT_CACHE = (1 << 2),
+
+	/* Return as soon as the clocks are usable, with provisional calibration
+	 * from a single short measurement, and refine it on a background
+	 * thread. Conversions stay consistent while the results are updated.
+	 */
+	LIBTIME_INIT_ASYNC = (1 << 3),
+
+	/* Lower the calling thread's timer slack to the minimum, as
+	 * libtime_set_timer_slack(1) does. Currently only supported on Linux.
+	 */
+	LIBTIME_INIT_TIMERSLACK = (1 << 4),
+};
+
+/* Same as libtime_init(), but with LIBTIME_INIT_* flags to control how the
+ * clocks are set up.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_init_flags(unsigned int flags);
+
+/* Wait for background calibration started by LIBTIME_INIT_ASYNC to finish.
+ * Returns immediately if there is none.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_init_wait(void);
+
+/* How libtime_init() found the clock behind a ClockType. Each candidate
+ * clock is read back to back in short runs, timed with the CPU clock.
+ */
+struct libtime_clock_info {
+	const char *name;       /* Underlying clock, e.g. "CLOCK_MONOTONIC" */
+	uint64_t resolution_ns; /* Resolution the clock reports */
+	uint64_t cost_min;      /* Cheapest read, in CPU clock cycles */
+	uint64_t cost_median;   /* Median read, in CPU clock cycles */
+	uint64_t backwards;     /* Readings seen going backwards */
+};
+
+/* Describe the clock that libtime_read() uses for 'type'. CLOCK_WALL and
+ * CLOCK_PRECISE get the cheapest monotonic clock with a resolution of a
+ * microsecond or better, CLOCK_WALL_FAST the cheapest of any resolution,
+ * and CLOCK_FAST the cheapest of those and the CPU clock, but only taking
+ * a coarse clock if it is several times cheaper. Returns NULL if 'type'
+ * isn't valid.
+ */
+extern LIBTIME_DLL_PUBLIC const struct libtime_clock_info *libtime_clock_info(ClockType type);
+
 /* Read the specified clock, return the current timestamp in nanoseconds. */
 static inline uint64_t libtime_read(ClockType type);
 
@@ -63,33 +126,341 @@ extern LIBTIME_DLL_PUBLIC uint64_t libtime_wall_fast(void);
  */
 static inline uint64_t libtime_cpu(void);
 
+/* Serializing variants of libtime_cpu() for timing short intervals. Take the
+ * start timestamp with libtime_cpu_start() and the end timestamp with
+ * libtime_cpu_stop(), which keeps the code being measured from being
+ * reordered around either read. If 'aux' is non-NULL, libtime_cpu_stop()
+ * stores the processor's TSC_AUX value there (on Linux, the CPU and node
+ * number), so callers can discard intervals which migrated between CPUs.
+ * Where no serializing read exists, these fall back to libtime_cpu() and
+ * 'aux' is set to zero.
+ */
+static inline uint64_t libtime_cpu_start(void);
+static inline uint64_t libtime_cpu_stop(uint32_t *aux);
+
 /* Converts libtime_cpu() values to nanoseconds. */
 extern LIBTIME_DLL_PUBLIC uint64_t libtime_cpu_to_wall(uint64_t clock);
 
-/* Converts nanoseconds to CPU clock cycles. */
+/* Converts nanoseconds to CPU clock cycles. Results which don't fit in 64
+ * bits saturate to UINT64_MAX.
+ */
 extern LIBTIME_DLL_PUBLIC uint64_t libtime_wall_to_cpu(uint64_t ns);
 
+/* Batch versions of libtime_cpu_to_wall() and libtime_wall_to_cpu(), which
+ * convert 'n' values from 'in' into 'out' (which may be the same array).
+ * Both use AVX2 or AVX-512 when the processor supports them.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_cpu_to_wall_batch(const uint64_t *in, uint64_t *out, size_t n);
+extern LIBTIME_DLL_PUBLIC void libtime_wall_to_cpu_batch(const uint64_t *in, uint64_t *out, size_t n);
+
 /* Read the CPU clock, return the timestamp in nanoseconds.
  */
 extern LIBTIME_DLL_PUBLIC uint64_t libtime_cpu_ns(void);
 
+/* Inline equivalents of libtime_cpu_to_wall() and libtime_cpu_ns(), for hot
+ * paths which can't afford a function call per timestamp.
+ */
+static inline uint64_t libtime_cpu_to_wall_inline(uint64_t clock);
+static inline uint64_t libtime_cpu_ns_inline(void);
+
+/* Start a background thread which keeps libtime_cpu_ns() in step with
+ * libtime_wall() over long uptimes. Every 'interval_ns' nanoseconds (or a
+ * default of ten seconds if zero) it compares the two clocks, refines the CPU
+ * clock rate over the whole baseline since it started, and corrects any
+ * accumulated offset by slewing the rate by at most 500ppm. libtime_cpu_ns()
+ * never steps and never goes backwards. Returns 0 on success.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_drift_start(uint64_t interval_ns);
+
+/* Stop the thread started by libtime_drift_start(). The last published
+ * conversion stays in effect.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_drift_stop(void);
+
 /* A high-precision sleep function. Attempts to sleep for exactly 'ns'
  * nanoseconds. Will never sleep for less.
  */
 extern LIBTIME_DLL_PUBLIC void libtime_nanosleep(int64_t ns);
 
+/* Sleep until libtime_read(type) reaches 'deadline_ns', with the same
+ * precision as libtime_nanosleep(). Pacing a loop off absolute deadlines
+ * doesn't accumulate error from one period to the next, and where the system
+ * supports it the coarse part of the wait is a single absolute-time sleep.
+ * Returns immediately if the deadline has already passed.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_sleep_until(uint64_t deadline_ns, ClockType type);
+
+/* How libtime_nanosleep() waits out the final stretch of a sleep, which is
+ * too short to hand to the system sleep.
+ */
+typedef enum {
+	/* SPIN_TPAUSE where the processor supports it, otherwise SPIN_PAUSE. */
+	SPIN_AUTO = 0,
+	/* Poll the clock in a tight loop. This is what libtime_nanosleep() used
+	 * to do, and it keeps the core (and its hyperthread sibling) busy.
+	 */
+	SPIN_BUSY = 1,
+	/* Poll the clock with a growing run of PAUSE instructions in between,
+	 * backing off again as the deadline approaches.
+	 */
+	SPIN_PAUSE = 2,
+	/* Wait in the TPAUSE light sleep state (x86 WAITPKG) until the
+	 * deadline. Falls back to SPIN_PAUSE if unsupported.
+	 */
+	SPIN_TPAUSE = 3,
+} SpinMode;
+
+/* Set how libtime_nanosleep() spins, for all threads. If 'budget_ns' is
+ * non-zero, at most that much of each sleep is spent spinning; the rest goes
+ * to the system sleep, even where that risks overshooting. Zero lets the
+ * spin phase cover the measured system sleep granularity.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_set_spin(SpinMode mode, uint64_t budget_ns);
+
+/* Turn the calling thread's adaptive sleep model on or off (it starts off).
+ * Normally libtime_nanosleep() stops making system sleeps, and starts
+ * spinning, once the remaining time is under the worst-case system sleep
+ * measured by libtime_init(). With the model on, that crossover follows the
+ * mean plus four mean deviations of how late this thread's own system sleeps
+ * have actually woken, so it tracks changes in load. Sleeps still never end
+ * early, since the spin phase always runs to the deadline.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_sleep_adaptive(int enable);
+
+/* The sleep-to-spin crossover currently used by the calling thread, in
+ * nanoseconds.
+ */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_sleep_margin(void);
+
+/* Set the calling thread's timer slack, which is how late the kernel may
+ * let its sleeps run so that it can batch wakeups (50us by default on
+ * Linux), and measure the worst-case system sleep again at the new setting.
+ * A low slack lets libtime_nanosleep() hand more of each sleep to the
+ * system and spin less. Zero restores the thread's default slack and the
+ * measurement from libtime_init(). Returns 0 on success, non-zero if the
+ * slack can't be changed. Currently only supported on Linux.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_set_timer_slack(uint64_t slack_ns);
+
+/* Sleep parameters in effect for the calling thread, in nanoseconds. */
+struct libtime_sleep_info {
+	int64_t timer_slack_ns; /* Timer slack, or -1 if not known */
+	uint64_t max_sleep_ns;  /* Worst-case system sleep */
+	uint64_t overhead_ns;   /* Fixed cost of a libtime_nanosleep() call */
+	uint64_t margin_ns;     /* Sleep-to-spin crossover */
+};
+
+/* Fill in 'info' for the calling thread. */
+extern LIBTIME_DLL_PUBLIC void libtime_sleep_info(struct libtime_sleep_info *info);
+
+/* Spin phase statistics, counted separately for each thread. */
+struct libtime_spin_stats {
+	uint64_t spins;         /* Number of spin phases */
+	uint64_t spin_ns;       /* Total time spent spinning */
+	uint64_t max_spin_ns;   /* Longest single spin phase */
+	uint64_t late_ns;       /* Total time spins overran their deadlines */
+};
+
+/* Copy the calling thread's spin statistics to 'stats', then reset them if
+ * 'reset' is non-zero.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_spin_stats(struct libtime_spin_stats *stats, int reset);
+
 typedef uint64_t (*clock_pfn)(void);
 extern clock_pfn _libtime_clocks[CLOCK_TYPE_MAX + 1];
 
+/* The clock backing each ClockType, chosen by libtime_init(). Mirrors
+ * _libtime_clocks, but lets libtime_read() make a direct call (or inline the
+ * CPU clock read) rather than an indirect one.
+ */
+typedef enum {
+	CLOCK_SOURCE_CPU = 0,
+	CLOCK_SOURCE_WALL = 1,
+	CLOCK_SOURCE_WALL_FAST = 2,
+} ClockSource;
+extern LIBTIME_DLL_PUBLIC uint8_t _libtime_sources[CLOCK_TYPE_MAX + 1];
+
+#include "libtime_cpu.h"
+
+/* Parameters for converting CPU clock values to nanoseconds. Written by
+ * libtime_init() (and by background calibration, if enabled) and read by
+ * every conversion, so they are packed onto a single cache line of their own.
+ * Updates are published under the 'seq' sequence count, so that readers never
+ * see a mix of old and new parameters.
+ */
+struct LIBTIME_CACHELINE_ALIGNED libtime_cpu_conv {
+	uint32_t seq;
+
+	/* ns = (cycles * clock_mult) >> clock_shift, and
+	 * cycles = (ns * cycles_mult) >> cycles_shift, both taken from the
+	 * full 128-bit product so that they hold over the whole 64-bit range.
+	 */
+	uint8_t clock_shift;
+	uint8_t cycles_shift;
+	uint64_t clock_mult;
+	uint64_t cycles_mult;
+	uint64_t cycles_per_msec;
+
+	/* libtime_cpu_ns() counts from base_nsecs at CPU clock value
+	 * base_cycles, so that rate changes don't make it jump.
+	 */
+	uint64_t base_cycles;
+	uint64_t base_nsecs;
+};
+extern LIBTIME_DLL_PUBLIC struct libtime_cpu_conv _libtime_cpu_conv;
+
+/* Sequence count read side. Wait for an even (stable) count, read the
+ * protected data, then retry if the count changed in the meantime.
+ */
+static inline uint32_t _libtime_seq_begin(const uint32_t *seq)
+{
+	uint32_t s;
+	do {
+#if defined(__GNUC__)
+		s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+#else
+		s = *(volatile const uint32_t *)seq;
+#endif
+	} while (s & 1);
+	return s;
+}
+
+static inline int _libtime_seq_retry(const uint32_t *seq, uint32_t s)
+{
+#if defined(__GNUC__)
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+#else
+#  if defined(_MSC_VER)
+	_ReadWriteBarrier();
+#  endif
+	return *(volatile const uint32_t *)seq != s;
+#endif
+}
+
+static inline void _libtime_cpu_conv_copy(struct libtime_cpu_conv *out)
+{
+	const struct libtime_cpu_conv *conv = &_libtime_cpu_conv;
+	out->clock_shift = conv->clock_shift;
+	out->cycles_shift = conv->cycles_shift;
+	out->clock_mult = conv->clock_mult;
+	out->cycles_mult = conv->cycles_mult;
+	out->cycles_per_msec = conv->cycles_per_msec;
+	out->base_cycles = conv->base_cycles;
+	out->base_nsecs = conv->base_nsecs;
+}
+
+/* Take a consistent copy of the conversion parameters. */
+static inline void _libtime_cpu_conv_read(struct libtime_cpu_conv *out)
+{
+	uint32_t seq;
+	do {
+		seq = _libtime_seq_begin(&_libtime_cpu_conv.seq);
+		_libtime_cpu_conv_copy(out);
+	} while (_libtime_seq_retry(&_libtime_cpu_conv.seq, seq));
+}
+
+/* (x * mult) >> shift, computed on the full 128-bit product. Results which
+ * don't fit in 64 bits saturate to UINT64_MAX. 'shift' must be below 128.
+ */
+static inline uint64_t _libtime_mul_shift(uint64_t x, uint64_t mult, unsigned int shift)
+{
+	uint64_t hi, lo;
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 p = (unsigned __int128)x * mult;
+	hi = (uint64_t)(p >> 64);
+	lo = (uint64_t)p;
+#elif defined(_MSC_VER) && defined(_M_X64)
+	lo = x * mult;
+	hi = __umulh(x, mult);
+#else
+	uint64_t ll, lh, hl, mid;
+	ll = (x & 0xffffffff) * (mult & 0xffffffff);
+	lh = (x & 0xffffffff) * (mult >> 32);
+	hl = (x >> 32) * (mult & 0xffffffff);
+	mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+	lo = (ll & 0xffffffff) | (mid << 32);
+	hi = (x >> 32) * (mult >> 32) + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+	if (shift >= 64)
+		return hi >> (shift - 64);
+	if (hi >> shift)
+		return UINT64_MAX;
+	return shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+}
+
+static inline uint64_t _libtime_cpu_scale(const struct libtime_cpu_conv *conv, uint64_t clock)
+{
+	return _libtime_mul_shift(clock, conv->clock_mult, conv->clock_shift);
+}
+
+static inline uint64_t _libtime_wall_scale(const struct libtime_cpu_conv *conv, uint64_t ns)
+{
+	return _libtime_mul_shift(ns, conv->cycles_mult, conv->cycles_shift);
+}
+
+/* Convert an absolute CPU clock value to the libtime_cpu_ns() timeline. */
+static inline uint64_t _libtime_cpu_ns_at(const struct libtime_cpu_conv *conv, uint64_t clock)
+{
+	if (clock >= conv->base_cycles)
+		return conv->base_nsecs + _libtime_cpu_scale(conv, clock - conv->base_cycles);
+	return conv->base_nsecs - _libtime_cpu_scale(conv, conv->base_cycles - clock);
+}
+
+static inline uint64_t libtime_cpu_to_wall_inline(uint64_t clock)
+{
+	struct libtime_cpu_conv conv;
+	_libtime_cpu_conv_read(&conv);
+	return _libtime_cpu_scale(&conv, clock);
+}
+
+/* The CPU clock is read inside the sequence count, so that it can't predate
+ * parameters rebased after it was read, which would step backwards.
+ */
+static inline uint64_t libtime_cpu_ns_inline(void)
+{
+	struct libtime_cpu_conv conv;
+	uint64_t clock;
+	uint32_t seq;
+	do {
+		seq = _libtime_seq_begin(&_libtime_cpu_conv.seq);
+		_libtime_cpu_conv_copy(&conv);
+		clock = libtime_cpu();
+	} while (_libtime_seq_retry(&_libtime_cpu_conv.seq, seq));
+	return _libtime_cpu_ns_at(&conv, clock);
+}
+
 static inline uint64_t libtime_read(ClockType type)
 {
-	uint64_t rv = (*_libtime_clocks[type])();
+	uint64_t rv;
+#if defined(__GNUC__)
+	/* When the clock type is known at compile time, skip the function
+	 * pointer table. CLOCK_WALL and CLOCK_WALL_FAST never change, and the
+	 * others are a well-predicted branch on their selected source.
+	 */
+	if (__builtin_constant_p(type)) {
+		switch (type == CLOCK_WALL ? CLOCK_SOURCE_WALL :
+		        type == CLOCK_WALL_FAST ? CLOCK_SOURCE_WALL_FAST :
+		        (ClockSource)_libtime_sources[type]) {
+		case CLOCK_SOURCE_CPU:
+			rv = libtime_cpu_ns_inline();
+			break;
+		case CLOCK_SOURCE_WALL:
+			rv = libtime_wall();
+			break;
+		default:
+			rv = libtime_wall_fast();
+			break;
+		}
+		LIBTIME_ASSUME(rv != 0);
+		return rv;
+	}
+#endif
+	rv = (*_libtime_clocks[type])();
 	LIBTIME_ASSUME(rv != 0);
 	return rv;
 }
 
-#include "libtime_cpu.h"
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,179 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_hpp
+#define __included_libtime_hpp
+
+#include <chrono>
+#include <limits>
+#include <ratio>
+#include <type_traits>
+
+#include "libtime.h"
+
+namespace libtime {
+
+/* The representation of a tsc_clock duration: a count of raw CPU clock
+ * cycles, which the duration labels as nanoseconds. Adding, subtracting and
+ * comparing stay in cycles. The cycles are converted to nanoseconds only
+ * when the value leaves this type, for example through duration_cast or by
+ * assigning it to std::chrono::nanoseconds. The conversion uses the
+ * calibration current at that point.
+ */
+class tsc_ticks {
+public:
+	constexpr tsc_ticks() : ticks_(0) {}
+
+	/* From nanoseconds, so that duration_cast to tsc_clock::duration is
+	 * correct. Use from_raw() for a cycle count.
+	 */
+	explicit tsc_ticks(int64_t ns) : ticks_(to_ticks(ns)) {}
+
+	static constexpr tsc_ticks from_raw(int64_t ticks) { return tsc_ticks(ticks, 0); }
+
+	constexpr int64_t raw() const { return ticks_; }
+
+	operator int64_t() const
+	{
+		if (ticks_ < 0)
+			return -(int64_t)libtime_cpu_to_wall((uint64_t)-ticks_);
+		return (int64_t)libtime_cpu_to_wall((uint64_t)ticks_);
+	}
+
+	tsc_ticks &operator+=(const tsc_ticks &o) { ticks_ += o.ticks_; return *this; }
+	tsc_ticks &operator-=(const tsc_ticks &o) { ticks_ -= o.ticks_; return *this; }
+	tsc_ticks &operator++() { ++ticks_; return *this; }
+	tsc_ticks &operator--() { --ticks_; return *this; }
+	tsc_ticks operator++(int) { tsc_ticks t = *this; ++ticks_; return t; }
+	tsc_ticks operator--(int) { tsc_ticks t = *this; --ticks_; return t; }
+	tsc_ticks operator-() const { return from_raw(-ticks_); }
+	tsc_ticks operator+() const { return *this; }
+
+	friend tsc_ticks operator+(tsc_ticks a, const tsc_ticks &b) { return a += b; }
+	friend tsc_ticks operator-(tsc_ticks a, const tsc_ticks &b) { return a -= b; }
+	friend bool operator==(const tsc_ticks &a, const tsc_ticks &b) { return a.ticks_ == b.ticks_; }
+	friend bool operator!=(const tsc_ticks &a, const tsc_ticks &b) { return a.ticks_ != b.ticks_; }
+	friend bool operator<(const tsc_ticks &a, const tsc_ticks &b) { return a.ticks_ < b.ticks_; }
+	friend bool operator<=(const tsc_ticks &a, const tsc_ticks &b) { return a.ticks_ <= b.ticks_; }
+	friend bool operator>(const tsc_ticks &a, const tsc_ticks &b) { return a.ticks_ > b.ticks_; }
+	friend bool operator>=(const tsc_ticks &a, const tsc_ticks &b) { return a.ticks_ >= b.ticks_; }
+
+private:
+	constexpr tsc_ticks(int64_t ticks, int) : ticks_(ticks) {}
+
+	static int64_t to_ticks(int64_t ns)
+	{
+		if (ns < 0)
+			return -(int64_t)libtime_wall_to_cpu((uint64_t)-ns);
+		return (int64_t)libtime_wall_to_cpu((uint64_t)ns);
+	}
+
+	int64_t ticks_;
+};
+
+}
+
+/* Mixing tsc_ticks with arithmetic types gives nanoseconds, so, for
+ * instance, a tsc_clock::duration times an int is a std::chrono::nanoseconds.
+ */
+namespace std {
+
+template <class T>
+struct common_type<libtime::tsc_ticks, T> {
+	typedef typename common_type<int64_t, T>::type type;
+};
+
+template <class T>
+struct common_type<T, libtime::tsc_ticks> {
+	typedef typename common_type<T, int64_t>::type type;
+};
+
+template <>
+struct common_type<libtime::tsc_ticks, libtime::tsc_ticks> {
+	typedef libtime::tsc_ticks type;
+};
+
+namespace chrono {
+
+template <>
+struct duration_values<libtime::tsc_ticks> {
+	static constexpr libtime::tsc_ticks zero() { return libtime::tsc_ticks(); }
+	static constexpr libtime::tsc_ticks min() { return libtime::tsc_ticks::from_raw(numeric_limits<int64_t>::min()); }
+	static constexpr libtime::tsc_ticks max() { return libtime::tsc_ticks::from_raw(numeric_limits<int64_t>::max()); }
+};
+
+}
+
+}
+
+namespace libtime {
+
+/* The CPU clock, as read by libtime_cpu(). Reads cost no more than the bare
+ * instruction, and time points and durations hold raw cycles until they are
+ * converted. Only meaningful after libtime_init().
+ */
+struct tsc_clock {
+	typedef tsc_ticks rep;
+	typedef std::nano period;
+	typedef std::chrono::duration<rep, period> duration;
+	typedef std::chrono::time_point<tsc_clock> time_point;
+	static constexpr bool is_steady = true;
+
+	static time_point now() noexcept
+	{
+		return time_point(duration(tsc_ticks::from_raw((int64_t)libtime_cpu())));
+	}
+};
+
+/* Drop-in replacements for std::chrono::steady_clock over libtime_read(),
+ * counting nanoseconds.
+ */
+struct fast_clock {
+	typedef int64_t rep;
+	typedef std::nano period;
+	typedef std::chrono::duration<rep, period> duration;
+	typedef std::chrono::time_point<fast_clock> time_point;
+	static constexpr bool is_steady = true;
+
+	static time_point now() noexcept
+	{
+		return time_point(duration((rep)libtime_read(CLOCK_FAST)));
+	}
+};
+
+struct precise_clock {
+	typedef int64_t rep;
+	typedef std::nano period;
+	typedef std::chrono::duration<rep, period> duration;
+	typedef std::chrono::time_point<precise_clock> time_point;
+	static constexpr bool is_steady = true;
+
+	static time_point now() noexcept
+	{
+		return time_point(duration((rep)libtime_read(CLOCK_PRECISE)));
+	}
+};
+
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
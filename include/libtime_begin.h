@@ -70,6 +70,10 @@
     #pragma pop_macro("_interlockedbittestandreset")
     #pragma pop_macro("_interlockedbittestandset")
   #endif
+  #if _MSC_VER >= 1500
+    #include <intrin.h>
+    #pragma intrinsic(__rdtscp)
+  #endif
   #if _MSC_VER >= 1400
     #pragma intrinsic(__rdtsc)
   #else
@@ -83,4 +87,12 @@
   #define LIBTIME_ASSUME(x)
 #endif
 
+#if defined(_MSC_VER)
+  #define LIBTIME_CACHELINE_ALIGNED __declspec(align(64))
+#elif defined(__GNUC__)
+  #define LIBTIME_CACHELINE_ALIGNED __attribute__ ((aligned (64)))
+#else
+  #define LIBTIME_CACHELINE_ALIGNED
+#endif
+
 /* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,101 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_bench_h
+#define __included_libtime_bench_h
+
+#include "libtime.h"
+
+#include <stdio.h>
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A micro-benchmark harness.
+ *
+ * The operation being measured is run in samples of a fixed number of
+ * iterations, chosen during warmup so that each sample takes about the
+ * target time. Each sample is timed with the serializing CPU clock reads,
+ * so that even small kernels are measured from start to finish, and the
+ * cost of an empty sample is subtracted. Samples further than one standard
+ * deviation from the mean are rejected as outliers, and the rest averaged.
+ * libtime_init() must have been called.
+ */
+
+/* Run the operation being measured 'iters' times. */
+typedef void (*libtime_bench_fn)(void *arg, uint64_t iters);
+
+struct libtime_bench_config {
+	uint64_t target_ns;     /* Length of each sample, 10ms if zero */
+	uint64_t warmup_ns;     /* Minimum warmup, 100ms if zero */
+	unsigned int samples;   /* Number of samples, 30 if zero */
+};
+
+struct libtime_bench_result {
+	const char *name;
+	uint64_t iters;         /* Iterations per sample */
+	unsigned int samples;   /* Samples taken */
+	unsigned int kept;      /* Samples which weren't outliers */
+	double overhead;        /* Cycles subtracted from each sample */
+	double cycles;          /* Mean CPU clock cycles per iteration */
+	double cycles_ci;       /* Half-width of the 95% confidence interval */
+	double cycles_stddev;
+	double ns;              /* The same, in nanoseconds */
+	double ns_ci;
+	double ns_stddev;
+};
+
+/* Benchmark 'fn'. 'config' may be NULL for the defaults. Returns 0 on
+ * success, non-zero if out of memory or if 'fn' doesn't take longer for
+ * more iterations, so that no iteration count reaches the target time.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_bench_run(const char *name, libtime_bench_fn fn, void *arg,
+                                                const struct libtime_bench_config *config,
+                                                struct libtime_bench_result *result);
+
+/* Write 'n' results to 'f' as a JSON array. Returns 0 on success, non-zero
+ * on a write error.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_bench_json(FILE *f, const struct libtime_bench_result *results, size_t n);
+
+/* Keep the compiler from optimizing away the computation of 'v'. */
+static inline void libtime_bench_use(uint64_t v)
+{
+#if defined(__GNUC__)
+	__asm__ __volatile__("" : : "r"(v) : "memory");
+#else
+	static volatile uint64_t sink;
+	sink = v;
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
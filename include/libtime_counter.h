@@ -0,0 +1,79 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_counter_h
+#define __included_libtime_counter_h
+
+#include "libtime.h"
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A duration counter which many threads can add to at once.
+ *
+ * Each thread adds into its own cache line sized shard of the counter, so
+ * threads never write to the same memory and adding is no more expensive
+ * than updating a local. The shards keep raw CPU clock cycles; reading the
+ * counter adds them all up and only then converts to nanoseconds.
+ *
+ * Up to 256 threads at a time get shards of their own. Threads beyond that
+ * share one, and are serialized against each other when adding to it.
+ */
+struct libtime_counter;
+
+struct libtime_counter_stats {
+	uint64_t count;             /* Number of durations added */
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t mean_ns;
+	uint64_t stddev_ns;         /* Sample standard deviation */
+};
+
+/* Create an empty counter. Returns NULL if out of memory. */
+extern LIBTIME_DLL_PUBLIC struct libtime_counter *libtime_counter_create(void);
+
+/* Free a counter. Nothing may be adding to it any more. */
+extern LIBTIME_DLL_PUBLIC void libtime_counter_destroy(struct libtime_counter *c);
+
+/* Add a duration of 'ticks' CPU clock cycles, such as the difference between
+ * two libtime_cpu() readings, to the calling thread's shard.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_counter_add(struct libtime_counter *c, uint64_t ticks);
+
+/* Sum up the counter. This may run while other threads are adding to it,
+ * and sees each addition either entirely or not at all. All zero if
+ * nothing has been added yet.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_counter_read(const struct libtime_counter *c, struct libtime_counter_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -46,6 +46,44 @@ static inline uint64_t libtime_cpu(void)
     return ((uint64_t) hi << 32ULL) | lo;
 #  endif /* _MSC_VER */
 }
+
+#  if !defined(_MSC_VER) || _MSC_VER >= 1500
+#define FOUND_FENCED_CPU_CLOCK
+/*
+ * The LFENCE before RDTSC keeps the read from executing until everything
+ * before it has completed. RDTSCP waits for prior instructions by itself, and
+ * the trailing LFENCE stops later instructions from starting before the read.
+ */
+static inline uint64_t libtime_cpu_start(void)
+{
+#    ifdef _MSC_VER
+    _mm_lfence();
+    return __rdtsc();
+#    else
+    uint32_t lo, hi;
+    __asm__ __volatile__("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+    return ((uint64_t) hi << 32ULL) | lo;
+#    endif
+}
+
+static inline uint64_t libtime_cpu_stop(uint32_t *aux)
+{
+#    ifdef _MSC_VER
+    unsigned int tsc_aux;
+    uint64_t ticks = __rdtscp(&tsc_aux);
+    _mm_lfence();
+    if (aux)
+        *aux = tsc_aux;
+    return ticks;
+#    else
+    uint32_t lo, hi, tsc_aux;
+    __asm__ __volatile__("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi), "=c" (tsc_aux) :: "memory");
+    if (aux)
+        *aux = tsc_aux;
+    return ((uint64_t) hi << 32ULL) | lo;
+#    endif
+}
+#  endif
 #endif
 
 /*
@@ -100,4 +138,23 @@ static inline uint64_t libtime_cpu(void)
 #undef FOUND_CPU_CLOCK
 #endif
 
+/*
+ * Fallback: no serializing read, use the plain CPU clock
+ */
+#if !defined(FOUND_FENCED_CPU_CLOCK)
+static inline uint64_t libtime_cpu_start(void)
+{
+    return libtime_cpu();
+}
+
+static inline uint64_t libtime_cpu_stop(uint32_t *aux)
+{
+    if (aux)
+        *aux = 0;
+    return libtime_cpu();
+}
+#else
+#undef FOUND_FENCED_CPU_CLOCK
+#endif
+
 /* vim: set ts=4 sw=4 noai noet: */
@@ -22,5 +22,6 @@
 #undef LIBTIME_DLL_PUBLIC
 #undef LIBTIME_DLL_LOCAL
 #undef LIBTIME_ASSUME
+#undef LIBTIME_CACHELINE_ALIGNED
 
 /* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,139 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_hist_h
+#define __included_libtime_hist_h
+
+#include "libtime.h"
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A high dynamic range histogram of CPU clock deltas.
+ *
+ * Values are bucketed as raw cycles with log-linear buckets: each power of
+ * two range is split into enough linear sub-buckets to hold the configured
+ * number of significant decimal digits. Recording is a bit scan, a shift and
+ * an increment. Nothing is converted to nanoseconds until the histogram is
+ * queried.
+ *
+ * A histogram has one writer. Give each thread its own and merge them to
+ * read the whole; libtime_hist_merge() may run while the source is being
+ * recorded to, and sees each count either before or after a given record.
+ *
+ * Treat the contents as private, and use the functions below.
+ */
+struct libtime_hist {
+	uint32_t sub_bucket_bits;   /* log2 of half the sub-buckets per bucket */
+	uint32_t len;               /* Entries in 'counts' */
+	uint64_t sub_bucket_mask;
+	uint64_t max;               /* Largest value tracked, in CPU clock cycles */
+	uint64_t *counts;
+};
+
+/* Create a histogram for deltas of up to 'max_ns' nanoseconds (an hour if
+ * zero), keeping 'digits' significant decimal digits (1 to 5). Larger
+ * deltas are counted as 'max_ns'. The range is converted to CPU clock cycles
+ * here, so libtime_init() must have been called. Returns NULL on failure.
+ */
+extern LIBTIME_DLL_PUBLIC struct libtime_hist *libtime_hist_create(uint64_t max_ns, int digits);
+
+extern LIBTIME_DLL_PUBLIC void libtime_hist_destroy(struct libtime_hist *h);
+
+/* Clear all counts. Not safe against concurrent libtime_hist_record(). */
+extern LIBTIME_DLL_PUBLIC void libtime_hist_reset(struct libtime_hist *h);
+
+static inline unsigned int _libtime_hist_log2(uint64_t v)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(v);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long r;
+	_BitScanReverse64(&r, v);
+	return r;
+#else
+	unsigned int r = 0;
+	while (v >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+/* Bucket b holds values of b + sub_bucket_bits + 1 bits, in sub-buckets
+ * (1 << b) cycles wide. Bucket 0 also covers all the smaller values.
+ */
+static inline uint32_t _libtime_hist_index(const struct libtime_hist *h, uint64_t v)
+{
+	unsigned int b = _libtime_hist_log2(v | h->sub_bucket_mask) - h->sub_bucket_bits;
+	return (uint32_t)((b << h->sub_bucket_bits) + (v >> b));
+}
+
+/* Record a delta of 'ticks' CPU clock cycles. */
+static inline void libtime_hist_record(struct libtime_hist *h, uint64_t ticks)
+{
+	uint64_t *c;
+
+	if (ticks > h->max)
+		ticks = h->max;
+	c = &h->counts[_libtime_hist_index(h, ticks)];
+#if defined(__GNUC__)
+	/* Not an atomic increment: the plain load and store just keep a
+	 * concurrent merge from seeing a torn value.
+	 */
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+#else
+	(*c)++;
+#endif
+}
+
+/* Add the counts in 'src' to 'dst'. Both must have been created with the
+ * same number of significant digits. Returns 0 on success, non-zero if they
+ * weren't.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_hist_merge(struct libtime_hist *dst, const struct libtime_hist *src);
+
+/* Number of values recorded. */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_hist_count(const struct libtime_hist *h);
+
+/* The value at or below which 'percentile' percent of the recorded values
+ * fall, in nanoseconds. This is the top of the sub-bucket holding that
+ * value, so it is never less than the value recorded. Returns 0 if the
+ * histogram is empty.
+ */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_hist_percentile(const struct libtime_hist *h, double percentile);
+
+/* The mean of the recorded values in nanoseconds, taking each one as the
+ * middle of its sub-bucket. Returns 0 if the histogram is empty.
+ */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_hist_mean(const struct libtime_hist *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,118 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_ticker_h
+#define __included_libtime_ticker_h
+
+#include "libtime.h"
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What libtime_ticker_wait() does about ticks whose time has already passed. */
+typedef enum {
+	/* Return each late tick immediately, one per call, until the ticker
+	 * has caught up with its schedule.
+	 */
+	TICKER_BURST = 0,
+	/* Drop every tick whose time has passed, and wait for the next one on
+	 * the original schedule.
+	 */
+	TICKER_SKIP = 1,
+	/* Return the late tick immediately and restart the schedule from
+	 * there, so the next tick is a full period later.
+	 */
+	TICKER_RESET = 2,
+} TickerPolicy;
+
+#define LIBTIME_TICKER_BUCKETS 16
+
+/* Wakeup error statistics. The error is the time libtime_ticker_wait()
+ * returned, less the time of the tick it returned for.
+ */
+struct libtime_ticker_stats {
+	uint64_t ticks;         /* Ticks returned */
+	uint64_t missed;        /* Ticks dropped by TICKER_SKIP or TICKER_RESET */
+	uint64_t early;         /* Ticks returned before their time */
+	uint64_t late;          /* Ticks returned after their time */
+	int64_t min_error_ns;
+	int64_t max_error_ns;
+	int64_t mean_error_ns;
+
+	/* Distribution of early and late wakeups by size of the error. Bucket
+	 * 0 counts errors under 64ns, bucket i counts errors in
+	 * [2^(i+5), 2^(i+6)) ns, and the last bucket anything larger.
+	 */
+	uint64_t early_hist[LIBTIME_TICKER_BUCKETS];
+	uint64_t late_hist[LIBTIME_TICKER_BUCKETS];
+};
+
+/* A fixed-rate ticker, paced on the CPU clock. Treat the contents as
+ * private, and use the functions below.
+ */
+struct libtime_ticker {
+	uint64_t period;        /* In CPU clock cycles */
+	uint64_t next;          /* CPU clock value of the next tick */
+	TickerPolicy policy;
+
+	uint64_t ticks;
+	uint64_t missed;
+	uint64_t early;
+	uint64_t late;
+	int64_t min_error;
+	int64_t max_error;
+	int64_t sum_error;
+	uint64_t early_hist[LIBTIME_TICKER_BUCKETS];
+	uint64_t late_hist[LIBTIME_TICKER_BUCKETS];
+};
+
+/* Set up 't' to tick every 'period_ns' nanoseconds, with the first tick one
+ * period from now.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_ticker_init(struct libtime_ticker *t, uint64_t period_ns, TickerPolicy policy);
+
+/* Restart the schedule, with the next tick one period from now. Statistics
+ * are kept.
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_ticker_reset(struct libtime_ticker *t);
+
+/* Wait for the next tick, sleeping and then spinning the same way
+ * libtime_nanosleep() does. Returns the number of ticks missed: for
+ * TICKER_BURST, how many more ticks are already due after this one; for
+ * TICKER_SKIP and TICKER_RESET, how many were dropped.
+ */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_ticker_wait(struct libtime_ticker *t);
+
+/* Copy the ticker's wakeup statistics to 'stats'. */
+extern LIBTIME_DLL_PUBLIC void libtime_ticker_stats(const struct libtime_ticker *t, struct libtime_ticker_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
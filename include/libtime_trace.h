@@ -0,0 +1,87 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_trace_h
+#define __included_libtime_trace_h
+
+#include "libtime.h"
+#include "libtime_zone.h"
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	/* Chrome Trace Event JSON, for chrome://tracing and most viewers */
+	TRACE_JSON = 0,
+	/* Perfetto's protobuf trace format, for ui.perfetto.dev */
+	TRACE_PERFETTO = 1,
+} TraceFormat;
+
+/* One timed span on a thread. */
+struct libtime_trace_event {
+	const char *name;
+	uint64_t tid;
+	uint64_t start;         /* CPU clock value */
+	uint64_t end;           /* CPU clock value */
+};
+
+/* Where the output goes. Return 0 on success, non-zero to fail the export. */
+typedef int (*libtime_trace_write_fn)(void *arg, const void *data, size_t len);
+
+/* Start an export. Output is staged in a fixed-size buffer inside the
+ * exporter and handed to 'fn' whenever that fills, so the size of the trace
+ * makes no difference to memory use. Timestamps are taken relative to a
+ * reading of libtime_wall() made here. Returns NULL on failure.
+ */
+extern LIBTIME_DLL_PUBLIC struct libtime_trace *libtime_trace_open(TraceFormat format, libtime_trace_write_fn fn, void *arg);
+
+/* Same as libtime_trace_open(), writing to the file at 'path'. */
+extern LIBTIME_DLL_PUBLIC struct libtime_trace *libtime_trace_open_file(TraceFormat format, const char *path);
+
+/* Add 'n' events. Their CPU clock values are converted in batches with
+ * libtime_cpu_to_wall_batch(). Events need not be in any order. Returns 0
+ * on success, non-zero if output has failed.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_trace_write(struct libtime_trace *t, const struct libtime_trace_event *events, size_t n);
+
+/* A libtime_zone_fn, for libtime_zone_collect(libtime_trace_zones, t). */
+extern LIBTIME_DLL_PUBLIC void libtime_trace_zones(void *t, const struct libtime_zone_record *records, size_t n);
+
+/* Name the thread 'tid' in the trace. */
+extern LIBTIME_DLL_PUBLIC int libtime_trace_thread_name(struct libtime_trace *t, uint64_t tid, const char *name);
+
+/* Finish the output, flush it and free 't'. Returns 0 if everything was
+ * written, non-zero if anything failed.
+ */
+extern LIBTIME_DLL_PUBLIC int libtime_trace_close(struct libtime_trace *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,94 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_wheel_h
+#define __included_libtime_wheel_h
+
+#include "libtime.h"
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A hierarchical timing wheel, for keeping large numbers of timeouts.
+ * Deadlines are kept in CPU clock cycles, and rounded up to the wheel's
+ * resolution. Adding and cancelling timers is O(1), and expiring them is
+ * amortized O(1) per timer. A wheel isn't thread safe; give each thread its
+ * own.
+ */
+struct libtime_wheel;
+struct libtime_timer;
+
+typedef void (*libtime_timer_fn)(void *arg);
+
+/* Create a wheel with a resolution of at most 'resolution_ns' nanoseconds
+ * (or one millisecond, if zero). Returns NULL if out of memory.
+ */
+extern LIBTIME_DLL_PUBLIC struct libtime_wheel *libtime_wheel_create(uint64_t resolution_ns);
+
+/* Free a wheel, along with any timers still pending on it. */
+extern LIBTIME_DLL_PUBLIC void libtime_wheel_destroy(struct libtime_wheel *w);
+
+/* Arrange for 'fn(arg)' to be called by libtime_wheel_expire() once the CPU
+ * clock reaches 'deadline'. Returns a handle for libtime_wheel_cancel(), which
+ * stays valid until the timer fires or is cancelled, or NULL if out of
+ * memory.
+ */
+extern LIBTIME_DLL_PUBLIC struct libtime_timer *libtime_wheel_add_at(struct libtime_wheel *w, uint64_t deadline, libtime_timer_fn fn, void *arg);
+
+/* Same as libtime_wheel_add_at(), for a deadline 'timeout_ns' nanoseconds
+ * from now.
+ */
+extern LIBTIME_DLL_PUBLIC struct libtime_timer *libtime_wheel_add(struct libtime_wheel *w, uint64_t timeout_ns, libtime_timer_fn fn, void *arg);
+
+/* Cancel a pending timer. */
+extern LIBTIME_DLL_PUBLIC void libtime_wheel_cancel(struct libtime_wheel *w, struct libtime_timer *timer);
+
+/* Run the callbacks of every timer due by CPU clock value 'now', in
+ * deadline order to within the wheel's resolution. Callbacks may add and
+ * cancel timers. 'now' must not go backwards between calls. Returns the
+ * number of timers run.
+ */
+extern LIBTIME_DLL_PUBLIC size_t libtime_wheel_expire(struct libtime_wheel *w, uint64_t now);
+
+/* Returns the CPU clock value at which libtime_wheel_expire() next needs
+ * calling (which may be before the earliest deadline, to move far timers
+ * closer), or UINT64_MAX if no timers are pending.
+ */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_wheel_next(const struct libtime_wheel *w);
+
+/* Same as libtime_wheel_next(), as nanoseconds from CPU clock value 'now',
+ * ready for libtime_nanosleep(). Returns 0 if already due, or -1 if no timers
+ * are pending.
+ */
+extern LIBTIME_DLL_PUBLIC int64_t libtime_wheel_next_ns(const struct libtime_wheel *w, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
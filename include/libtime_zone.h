@@ -0,0 +1,130 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef __included_libtime_zone_h
+#define __included_libtime_zone_h
+
+#include "libtime.h"
+
+#include "libtime_begin.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A profiling zone: a named region of code. One of these is defined
+ * statically for each place a zone is opened, and its address identifies
+ * the zone in the records.
+ */
+struct libtime_zone_site {
+	const char *name;
+	const char *file;
+	uint32_t line;
+};
+
+/* An open zone. */
+struct libtime_zone {
+	const struct libtime_zone_site *site;
+	uint64_t start;         /* CPU clock value */
+};
+
+static inline void libtime_zone_begin(struct libtime_zone *z, const struct libtime_zone_site *site)
+{
+	z->site = site;
+	z->start = libtime_cpu();
+}
+
+/* Close the zone, and append it to the calling thread's ring buffer, as its
+ * site with raw CPU clock values for the start and end. Each thread has its
+ * own buffer and is the only writer to it, so this takes no locks. If the
+ * buffer is full, because the collector hasn't kept up, the zone is dropped
+ * and counted in libtime_zone_dropped().
+ */
+extern LIBTIME_DLL_PUBLIC void libtime_zone_end(struct libtime_zone *z);
+
+#define LIBTIME_ZONE_CONCAT_(a, b) a##b
+#define LIBTIME_ZONE_CONCAT(a, b) LIBTIME_ZONE_CONCAT_(a, b)
+#define LIBTIME_ZONE_SITE(name) \
+	static const struct libtime_zone_site LIBTIME_ZONE_CONCAT(_libtime_zone_site_, __LINE__) = \
+		{ name, __FILE__, __LINE__ }
+
+/* Time the rest of the enclosing scope as a zone called 'name', which must
+ * be a string literal. In C this needs GCC or clang, for the cleanup
+ * attribute; elsewhere, use libtime_zone_begin() and libtime_zone_end().
+ */
+#if defined(__cplusplus)
+#define LIBTIME_ZONE(name) \
+	LIBTIME_ZONE_SITE(name); \
+	libtime::zone_scope LIBTIME_ZONE_CONCAT(_libtime_zone_, __LINE__)(&LIBTIME_ZONE_CONCAT(_libtime_zone_site_, __LINE__))
+#elif defined(__GNUC__)
+#define LIBTIME_ZONE(name) \
+	LIBTIME_ZONE_SITE(name); \
+	struct libtime_zone LIBTIME_ZONE_CONCAT(_libtime_zone_, __LINE__) \
+		__attribute__((cleanup(libtime_zone_end))) = \
+		{ &LIBTIME_ZONE_CONCAT(_libtime_zone_site_, __LINE__), libtime_cpu() }
+#endif
+
+/* A collected zone. */
+struct libtime_zone_record {
+	const struct libtime_zone_site *site;
+	uint64_t thread_id;     /* Operating system thread ID */
+	uint64_t start_ns;      /* On the libtime_cpu_ns() timeline */
+	uint64_t duration_ns;
+};
+
+typedef void (*libtime_zone_fn)(void *arg, const struct libtime_zone_record *records, size_t n);
+
+/* Drain every thread's ring buffer, passing the zones to 'fn' in batches,
+ * oldest first for each thread. This is the only place CPU clock values are
+ * converted to nanoseconds, so it is meant to be called periodically from a
+ * collector thread, away from the threads being profiled. Calls are
+ * serialized against each other. Returns the number of zones collected.
+ */
+extern LIBTIME_DLL_PUBLIC size_t libtime_zone_collect(libtime_zone_fn fn, void *arg);
+
+/* Total number of zones dropped because a ring buffer was full. */
+extern LIBTIME_DLL_PUBLIC uint64_t libtime_zone_dropped(void);
+
+#ifdef __cplusplus
+}
+
+namespace libtime {
+
+class zone_scope {
+public:
+	explicit zone_scope(const struct libtime_zone_site *site) { libtime_zone_begin(&zone_, site); }
+	~zone_scope() { libtime_zone_end(&zone_); }
+
+private:
+	zone_scope(const zone_scope &);
+	zone_scope &operator=(const zone_scope &);
+
+	struct libtime_zone zone_;
+};
+
+}
+#endif
+
+#include "libtime_end.h"
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
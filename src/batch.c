@@ -0,0 +1,239 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_internal.h"
+
+#if defined(__GNUC__) && (defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64))
+#define USE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Computes out[i] = (in[i] * mult) >> shift, as _libtime_mul_shift() does. */
+typedef void (*batch_pfn)(const uint64_t *in, uint64_t *out, size_t n,
+                          uint64_t mult, unsigned int shift);
+
+static void mul_shift_scalar(const uint64_t *in, uint64_t *out, size_t n,
+                             uint64_t mult, unsigned int shift)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		out[i] = _libtime_mul_shift(in[i], mult, shift);
+}
+
+#ifdef USE_X86_SIMD
+
+/*
+ * Neither AVX2 nor AVX-512 has a 64x64->128 bit multiply, so the product is
+ * built out of four 32x32->64 bit multiplies. The shift is then done with
+ * variable shift counts which are set up once per batch:
+ *
+ *   shift <  64: (lo >> shift) | (hi << (64 - shift)), saturating if
+ *                (hi >> shift) is non-zero
+ *   shift >= 64: hi >> (shift - 64)
+ *
+ * Shift counts above 63 produce zero, which takes care of the terms that
+ * don't apply to each case without any branches in the loop.
+ */
+struct shift_counts {
+	__m128i lo_right;
+	__m128i hi_right;
+	__m128i hi_left;
+};
+
+static inline void shift_counts_init(struct shift_counts *c, unsigned int shift)
+{
+	c->lo_right = _mm_cvtsi32_si128(shift);
+	c->hi_right = _mm_cvtsi32_si128(shift >= 64 ? shift - 64 : 0);
+	c->hi_left = _mm_cvtsi32_si128(shift >= 64 ? 0 : 64 - shift);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mul_shift_avx2(__m256i a, __m256i b, __m256i b_hi,
+                                     const struct shift_counts *c)
+{
+	const __m256i low32 = _mm256_set1_epi64x(0xffffffff);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a_hi, ll, lh, hl, hh, mid, lo, hi, r, fits;
+
+	a_hi = _mm256_srli_epi64(a, 32);
+	ll = _mm256_mul_epu32(a, b);
+	lh = _mm256_mul_epu32(a, b_hi);
+	hl = _mm256_mul_epu32(a_hi, b);
+	hh = _mm256_mul_epu32(a_hi, b_hi);
+
+	mid = _mm256_add_epi64(_mm256_srli_epi64(ll, 32),
+	                       _mm256_add_epi64(_mm256_and_si256(lh, low32),
+	                                        _mm256_and_si256(hl, low32)));
+	lo = _mm256_or_si256(_mm256_and_si256(ll, low32), _mm256_slli_epi64(mid, 32));
+	hi = _mm256_add_epi64(_mm256_add_epi64(hh, _mm256_srli_epi64(mid, 32)),
+	                      _mm256_add_epi64(_mm256_srli_epi64(lh, 32),
+	                                       _mm256_srli_epi64(hl, 32)));
+
+	r = _mm256_or_si256(_mm256_srl_epi64(lo, c->lo_right),
+	                    _mm256_sll_epi64(_mm256_srl_epi64(hi, c->hi_right), c->hi_left));
+	fits = _mm256_cmpeq_epi64(_mm256_srl_epi64(hi, c->lo_right), zero);
+	return _mm256_or_si256(r, _mm256_andnot_si256(fits, _mm256_set1_epi64x(-1)));
+}
+
+__attribute__((target("avx2")))
+static void mul_shift_avx2_batch(const uint64_t *in, uint64_t *out, size_t n,
+                                 uint64_t mult, unsigned int shift)
+{
+	const __m256i b = _mm256_set1_epi64x(mult);
+	const __m256i b_hi = _mm256_set1_epi64x(mult >> 32);
+	struct shift_counts c;
+	__m256i x;
+	size_t i;
+
+	shift_counts_init(&c, shift);
+	for (i = 0; i + 4 <= n; i += 4) {
+		x = _mm256_loadu_si256((const __m256i *)(in + i));
+		_mm256_storeu_si256((__m256i *)(out + i), mul_shift_avx2(x, b, b_hi, &c));
+	}
+	mul_shift_scalar(in + i, out + i, n - i, mult, shift);
+}
+
+__attribute__((target("avx512f")))
+static void mul_shift_avx512_batch(const uint64_t *in, uint64_t *out, size_t n,
+                                   uint64_t mult, unsigned int shift)
+{
+	const __m512i low32 = _mm512_set1_epi64(0xffffffff);
+	const __m512i ones = _mm512_set1_epi64(-1);
+	const __m512i b = _mm512_set1_epi64(mult);
+	const __m512i b_hi = _mm512_set1_epi64(mult >> 32);
+	__m512i x, x_hi, ll, lh, hl, hh, mid, lo, hi, r;
+	struct shift_counts c;
+	__mmask8 m, over;
+	size_t i;
+
+	shift_counts_init(&c, shift);
+	for (i = 0; i < n; i += 8) {
+		/* The last partial vector is done with masked loads and stores. */
+		m = (n - i >= 8) ? 0xff : (__mmask8)((1U << (n - i)) - 1);
+		x = _mm512_maskz_loadu_epi64(m, in + i);
+
+		x_hi = _mm512_srli_epi64(x, 32);
+		ll = _mm512_mul_epu32(x, b);
+		lh = _mm512_mul_epu32(x, b_hi);
+		hl = _mm512_mul_epu32(x_hi, b);
+		hh = _mm512_mul_epu32(x_hi, b_hi);
+
+		mid = _mm512_add_epi64(_mm512_srli_epi64(ll, 32),
+		                       _mm512_add_epi64(_mm512_and_si512(lh, low32),
+		                                        _mm512_and_si512(hl, low32)));
+		lo = _mm512_or_si512(_mm512_and_si512(ll, low32), _mm512_slli_epi64(mid, 32));
+		hi = _mm512_add_epi64(_mm512_add_epi64(hh, _mm512_srli_epi64(mid, 32)),
+		                      _mm512_add_epi64(_mm512_srli_epi64(lh, 32),
+		                                       _mm512_srli_epi64(hl, 32)));
+
+		r = _mm512_or_si512(_mm512_srl_epi64(lo, c.lo_right),
+		                    _mm512_sll_epi64(_mm512_srl_epi64(hi, c.hi_right), c.hi_left));
+		over = _mm512_test_epi64_mask(_mm512_srl_epi64(hi, c.lo_right),
+		                              _mm512_srl_epi64(hi, c.lo_right));
+		r = _mm512_mask_mov_epi64(r, over, ones);
+		_mm512_mask_storeu_epi64(out + i, m, r);
+	}
+}
+
+static batch_pfn select_kernel(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return mul_shift_avx512_batch;
+	if (__builtin_cpu_supports("avx2"))
+		return mul_shift_avx2_batch;
+	return mul_shift_scalar;
+}
+
+#else
+
+static batch_pfn select_kernel(void)
+{
+	return mul_shift_scalar;
+}
+
+#endif
+
+static batch_pfn batch_kernel;
+
+static batch_pfn get_kernel(void)
+{
+	batch_pfn kernel;
+
+	kernel = READ_ONCE(batch_kernel);
+	if (!kernel) {
+		kernel = select_kernel();
+		WRITE_ONCE(batch_kernel, kernel);
+	}
+	return kernel;
+}
+
+int libtime_batch_set_kernel(enum libtime_batch_kernel which)
+{
+	batch_pfn kernel;
+
+#ifdef USE_X86_SIMD
+	__builtin_cpu_init();
+#endif
+	switch (which) {
+	case LIBTIME_BATCH_AUTO:
+		kernel = select_kernel();
+		break;
+	case LIBTIME_BATCH_SCALAR:
+		kernel = mul_shift_scalar;
+		break;
+#ifdef USE_X86_SIMD
+	case LIBTIME_BATCH_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return 1;
+		kernel = mul_shift_avx2_batch;
+		break;
+	case LIBTIME_BATCH_AVX512:
+		if (!__builtin_cpu_supports("avx512f"))
+			return 1;
+		kernel = mul_shift_avx512_batch;
+		break;
+#endif
+	default:
+		return 1;
+	}
+	WRITE_ONCE(batch_kernel, kernel);
+	return 0;
+}
+
+void libtime_cpu_to_wall_batch(const uint64_t *in, uint64_t *out, size_t n)
+{
+	struct libtime_cpu_conv conv;
+
+	_libtime_cpu_conv_read(&conv);
+	get_kernel()(in, out, n, conv.clock_mult, conv.clock_shift);
+}
+
+void libtime_wall_to_cpu_batch(const uint64_t *in, uint64_t *out, size_t n)
+{
+	struct libtime_cpu_conv conv;
+
+	_libtime_cpu_conv_read(&conv);
+	get_kernel()(in, out, n, conv.cycles_mult, conv.cycles_shift);
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,231 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_bench.h"
+#include "libtime_internal.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define DEFAULT_TARGET_NS 10000000ULL
+#define DEFAULT_WARMUP_NS 100000000ULL
+#define DEFAULT_SAMPLES 30
+
+#define NR_OVERHEAD_RUNS 255
+
+/* Largest step in the iteration count while looking for the target */
+#define MAX_GROWTH 16.0
+
+/* A kernel that doesn't take longer for more iterations never reaches the
+ * target, so give up past this count.
+ */
+#define MAX_ITERS (1ULL << 40)
+
+/* Two-sided 95% points of Student's t distribution, by degrees of freedom. */
+static const double t95[] = {
+	0.0,
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static double t_95(unsigned int df)
+{
+	return df < ELEM_SIZE(t95) ? t95[df] : 1.96;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * The serializing reads keep the kernel's instructions from being reordered
+ * out of the timed region, which would otherwise be a large part of a
+ * sample's time for anything small.
+ */
+static uint64_t time_run(libtime_bench_fn fn, void *arg, uint64_t iters)
+{
+	uint64_t s, e;
+
+	s = libtime_cpu_start();
+	fn(arg, iters);
+	e = libtime_cpu_stop(NULL);
+	return e - s;
+}
+
+static void bench_nop(void *arg, uint64_t iters)
+{
+}
+
+/*
+ * Median cost of timing a sample that does nothing. The empty function is
+ * called through a volatile pointer, so that it isn't inlined and costs the
+ * same call as the real one.
+ */
+static uint64_t measure_overhead(void)
+{
+	libtime_bench_fn volatile nop = bench_nop;
+	uint64_t runs[NR_OVERHEAD_RUNS];
+	int i;
+
+	for (i = 0; i < NR_OVERHEAD_RUNS; i++)
+		runs[i] = time_run(nop, NULL, 1);
+	qsort(runs, NR_OVERHEAD_RUNS, sizeof(runs[0]), compare_u64);
+	return runs[NR_OVERHEAD_RUNS / 2];
+}
+
+/*
+ * Grow the iteration count until a sample takes the target time, and keep
+ * going until the warmup time has passed as well. Returns 0 if the target
+ * can't be reached.
+ */
+static uint64_t find_iters(libtime_bench_fn fn, void *arg, uint64_t target, uint64_t warmup)
+{
+	uint64_t iters = 1, start, t;
+	double growth;
+
+	start = libtime_cpu();
+	for (;;) {
+		t = time_run(fn, arg, iters);
+		if (t >= target && libtime_cpu() - start >= warmup)
+			return iters;
+		if (t < target) {
+			growth = t ? (double)target / (double)t : MAX_GROWTH;
+			iters = (uint64_t)ceil((double)iters * fmin(growth, MAX_GROWTH));
+			if (iters > MAX_ITERS)
+				return 0;
+		}
+	}
+}
+
+int libtime_bench_run(const char *name, libtime_bench_fn fn, void *arg,
+                      const struct libtime_bench_config *config,
+                      struct libtime_bench_result *result)
+{
+	uint64_t target_ns = DEFAULT_TARGET_NS, warmup_ns = DEFAULT_WARMUP_NS, iters;
+	unsigned int nr_samples = DEFAULT_SAMPLES, i, kept;
+	double *samples, overhead, x, delta, mean, S, kept_mean, kept_S, ns_per_cycle;
+
+	if (config) {
+		if (config->target_ns)
+			target_ns = config->target_ns;
+		if (config->warmup_ns)
+			warmup_ns = config->warmup_ns;
+		if (config->samples)
+			nr_samples = config->samples;
+	}
+
+	overhead = (double)measure_overhead();
+	iters = find_iters(fn, arg, libtime_wall_to_cpu(target_ns), libtime_wall_to_cpu(warmup_ns));
+	if (!iters)
+		return 1;
+
+	samples = malloc(nr_samples * sizeof(*samples));
+	if (!samples)
+		return 1;
+
+	S = mean = 0.0;
+	for (i = 0; i < nr_samples; i++) {
+		x = (double)time_run(fn, arg, iters) - overhead;
+		if (x < 0.0)
+			x = 0.0;
+		x /= (double)iters;
+		samples[i] = x;
+		delta = x - mean;
+		mean += delta / (i + 1.0);
+		S += delta * (x - mean);
+	}
+	S = nr_samples > 1 ? sqrt(S / (nr_samples - 1.0)) : 0.0;
+
+	/* Average what's within a standard deviation of the mean. */
+	kept_S = kept_mean = 0.0;
+	kept = 0;
+	for (i = 0; i < nr_samples; i++) {
+		x = samples[i];
+		if ((fmax(x, mean) - fmin(x, mean)) > S)
+			continue;
+		kept++;
+		delta = x - kept_mean;
+		kept_mean += delta / kept;
+		kept_S += delta * (x - kept_mean);
+	}
+	kept_S = kept > 1 ? sqrt(kept_S / (kept - 1.0)) : 0.0;
+	free(samples);
+
+	ns_per_cycle = (double)libtime_cpu_to_wall(1000000000ULL) / 1e9;
+
+	result->name = name;
+	result->iters = iters;
+	result->samples = nr_samples;
+	result->kept = kept;
+	result->overhead = overhead;
+	result->cycles = kept_mean;
+	result->cycles_stddev = kept_S;
+	result->cycles_ci = kept ? t_95(kept - 1) * kept_S / sqrt((double)kept) : 0.0;
+	result->ns = result->cycles * ns_per_cycle;
+	result->ns_stddev = result->cycles_stddev * ns_per_cycle;
+	result->ns_ci = result->cycles_ci * ns_per_cycle;
+	return 0;
+}
+
+static void json_str(FILE *f, const char *s)
+{
+	unsigned char c;
+
+	fputc('"', f);
+	for (; *s; s++) {
+		c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+int libtime_bench_json(FILE *f, const struct libtime_bench_result *results, size_t n)
+{
+	const struct libtime_bench_result *r;
+	size_t i;
+
+	fputs("[", f);
+	for (i = 0; i < n; i++) {
+		r = &results[i];
+		fputs(i ? ",\n  {\"name\": " : "\n  {\"name\": ", f);
+		json_str(f, r->name ? r->name : "");
+		fprintf(f, ", \"iterations\": %llu, \"samples\": %u, \"kept\": %u, "
+		        "\"overhead_cycles\": %.1f, "
+		        "\"cycles_per_op\": %.3f, \"cycles_per_op_ci95\": %.3f, \"cycles_per_op_stddev\": %.3f, "
+		        "\"ns_per_op\": %.3f, \"ns_per_op_ci95\": %.3f, \"ns_per_op_stddev\": %.3f}",
+		        (unsigned long long)r->iters, r->samples, r->kept, r->overhead,
+		        r->cycles, r->cycles_ci, r->cycles_stddev,
+		        r->ns, r->ns_ci, r->ns_stddev);
+	}
+	fputs(n ? "\n]\n" : "]\n", f);
+	return ferror(f) ? 1 : 0;
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,213 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_internal.h"
+
+#include <stddef.h>
+
+static uint64_t fnv1a(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+uint64_t libtime_cache_checksum(const struct libtime_cache_file *file)
+{
+	return fnv1a(file, offsetof(struct libtime_cache_file, checksum));
+}
+
+#if defined(TARGET_OS_LINUX)
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int cache_path(char *path, size_t len)
+{
+	const char *env;
+	int r;
+
+	env = getenv("LIBTIME_CACHE");
+	if (env && *env) {
+		r = snprintf(path, len, "%s", env);
+	} else {
+		env = getenv("XDG_RUNTIME_DIR");
+		if (env && *env)
+			r = snprintf(path, len, "%s/libtime.cache", env);
+		else
+			r = snprintf(path, len, "/tmp/libtime-%u.cache", (unsigned int)getuid());
+	}
+	return (r < 0 || (size_t)r >= len) ? 1 : 0;
+}
+
+int libtime_cache_key(struct libtime_cache_key *key)
+{
+	ssize_t r;
+	int fd;
+
+	memset(key, 0, sizeof(*key));
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	r = read(fd, key->boot_id, sizeof(key->boot_id) - 1);
+	close(fd);
+	if (r < 32)
+		return 1;
+	key->boot_id[r] = 0;
+
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+	{
+		uint32_t regs[4], max_ext;
+		int i;
+
+		libtime_cpuid(1, 0, regs);
+		key->cpu_signature = regs[0];
+		key->tsc_flags = regs[3] & (1 << 4);      /* TSC */
+
+		libtime_cpuid(0x80000000, 0, regs);
+		max_ext = regs[0];
+		if (max_ext >= 0x80000004) {
+			for (i = 0; i < 3; i++) {
+				libtime_cpuid(0x80000002 + i, 0, regs);
+				memcpy(key->cpu_model + i * 16, regs, 16);
+			}
+		}
+		if (max_ext >= 0x80000007) {
+			libtime_cpuid(0x80000001, 0, regs);
+			key->tsc_flags |= regs[3] & (1 << 27);  /* RDTSCP */
+			libtime_cpuid(0x80000007, 0, regs);
+			key->tsc_flags |= regs[3] & (1 << 8);   /* Invariant TSC */
+		}
+	}
+#endif
+
+	return 0;
+}
+
+int libtime_cache_load(struct libtime_calibration *cal)
+{
+	struct libtime_cache_file file;
+	struct libtime_cache_key key;
+	char path[PATH_MAX];
+	struct stat st;
+	ssize_t r;
+	int fd;
+
+	if (cache_path(path, sizeof(path)) || libtime_cache_key(&key))
+		return 1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return 1;
+
+	/*
+	 * Only trust a regular file that we own and that nobody else could
+	 * have written to.
+	 */
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) || st.st_size != sizeof(file)) {
+		close(fd);
+		return 1;
+	}
+
+	r = read(fd, &file, sizeof(file));
+	close(fd);
+	if (r != sizeof(file))
+		return 1;
+
+	if (file.magic != LIBTIME_CACHE_MAGIC || file.version != LIBTIME_CACHE_VERSION ||
+	    file.size != sizeof(file) ||
+	    file.checksum != libtime_cache_checksum(&file))
+		return 1;
+
+	if (memcmp(&file.key, &key, sizeof(key)))
+		return 1;
+
+	if (!file.cal.cpu.cycles_per_msec || !file.cal.cpu.clock_mult ||
+	    !file.cal.cpu.cycles_mult)
+		return 1;
+
+	*cal = file.cal;
+	return 0;
+}
+
+void libtime_cache_store(const struct libtime_calibration *cal)
+{
+	struct libtime_cache_file file;
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	ssize_t r;
+	int fd;
+
+	if (cache_path(path, sizeof(path)))
+		return;
+
+	memset(&file, 0, sizeof(file));
+	if (libtime_cache_key(&file.key))
+		return;
+	file.magic = LIBTIME_CACHE_MAGIC;
+	file.version = LIBTIME_CACHE_VERSION;
+	file.size = sizeof(file);
+	file.cal = *cal;
+	file.checksum = libtime_cache_checksum(&file);
+
+	/*
+	 * Write to a temporary file and rename it into place, so that readers
+	 * see either the old file or the complete new one.
+	 */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	r = write(fd, &file, sizeof(file));
+	if (close(fd) || r != sizeof(file) || rename(tmp, path))
+		unlink(tmp);
+}
+
+#else
+
+int libtime_cache_key(struct libtime_cache_key *key)
+{
+	return 1;
+}
+
+int libtime_cache_load(struct libtime_calibration *cal)
+{
+	return 1;
+}
+
+void libtime_cache_store(const struct libtime_calibration *cal)
+{
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,361 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_counter.h"
+#include "libtime_internal.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(TARGET_OS_WINDOWS)
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <pthread.h>
+#endif
+
+#define CACHE_LINE 64
+
+/* Threads which can have shards of their own at once */
+#define NR_SLOTS 256
+
+/*
+ * Only the owning thread writes to a shard, bracketing each update with a
+ * sequence count so that readers can take a consistent copy. Durations are
+ * kept in CPU clock cycles, with a running mean and sum of squared
+ * differences from it (Welford's method) for the variance.
+ */
+struct counter_shard {
+	uint32_t seq;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	double mean;
+	double m2;
+	uint8_t pad[CACHE_LINE - 7 * sizeof(uint64_t)];
+};
+
+struct libtime_counter {
+	/* Shared by threads which couldn't get a slot */
+	struct counter_shard overflow;
+
+	/* Indexed by slot, and allocated by a slot's thread when first needed */
+	struct counter_shard *shards[NR_SLOTS];
+};
+
+/*
+ * Each thread using counters holds a slot, which indexes its shard in every
+ * counter. Slots are handed back when their thread exits, and a new thread
+ * taking the slot over carries on adding to the same shards. 0 means the
+ * thread has no slot yet, and NO_SLOT that there were none left or that it
+ * has given its slot back.
+ */
+#define NO_SLOT (NR_SLOTS + 1)
+
+static LIBTIME_THREAD_LOCAL unsigned int thread_slot;
+static uint8_t slot_used[NR_SLOTS];
+
+static unsigned int slot_find(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_SLOTS; i++) {
+		if (!slot_used[i]) {
+			slot_used[i] = 1;
+			return i + 1;
+		}
+	}
+	return NO_SLOT;
+}
+
+#if defined(TARGET_OS_WINDOWS)
+
+static SRWLOCK slot_lock = SRWLOCK_INIT;
+static INIT_ONCE exit_once = INIT_ONCE_STATIC_INIT;
+static DWORD exit_slot = FLS_OUT_OF_INDEXES;
+
+#define lock(l)   AcquireSRWLockExclusive(l)
+#define unlock(l) ReleaseSRWLockExclusive(l)
+
+static VOID WINAPI fls_exit(PVOID arg)
+{
+	if (arg) {
+		/* Later destructors adding to a counter go to the overflow shard. */
+		thread_slot = NO_SLOT;
+		lock(&slot_lock);
+		slot_used[(uintptr_t)arg - 1] = 0;
+		unlock(&slot_lock);
+	}
+}
+
+static BOOL CALLBACK exit_init(PINIT_ONCE once, PVOID param, PVOID *ctx)
+{
+	exit_slot = FlsAlloc(fls_exit);
+	return TRUE;
+}
+
+/* Give 'slot' back when the calling thread exits. Returns 0 on success. */
+static int slot_watch_exit(unsigned int slot)
+{
+	InitOnceExecuteOnce(&exit_once, exit_init, NULL, NULL);
+	if (exit_slot == FLS_OUT_OF_INDEXES)
+		return 1;
+	return !FlsSetValue(exit_slot, (PVOID)(uintptr_t)slot);
+}
+
+static void *shard_alloc(size_t size)
+{
+	return _aligned_malloc(size, CACHE_LINE);
+}
+
+static void shard_free(void *p)
+{
+	_aligned_free(p);
+}
+
+#else
+
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static int exit_key_ok;
+
+#define lock(l)   pthread_mutex_lock(l)
+#define unlock(l) pthread_mutex_unlock(l)
+
+static void key_exit(void *arg)
+{
+	/* The slot may be taken over as soon as it's handed back, so any
+	 * destructors running after this one add to the overflow shard.
+	 */
+	thread_slot = NO_SLOT;
+	lock(&slot_lock);
+	slot_used[(uintptr_t)arg - 1] = 0;
+	unlock(&slot_lock);
+}
+
+static void exit_init(void)
+{
+	exit_key_ok = !pthread_key_create(&exit_key, key_exit);
+}
+
+/* Give 'slot' back when the calling thread exits. Returns 0 on success. */
+static int slot_watch_exit(unsigned int slot)
+{
+	pthread_once(&exit_once, exit_init);
+	if (!exit_key_ok)
+		return 1;
+	return pthread_setspecific(exit_key, (void *)(uintptr_t)slot);
+}
+
+static void *shard_alloc(size_t size)
+{
+	void *p;
+	if (posix_memalign(&p, CACHE_LINE, size))
+		return NULL;
+	return p;
+}
+
+static void shard_free(void *p)
+{
+	free(p);
+}
+
+#endif
+
+static unsigned int slot_claim(void)
+{
+	unsigned int slot;
+
+	lock(&slot_lock);
+	slot = slot_find();
+	unlock(&slot_lock);
+
+	/* Without a way to get it back, the slot would be lost for good. */
+	if (slot != NO_SLOT && slot_watch_exit(slot)) {
+		lock(&slot_lock);
+		slot_used[slot - 1] = 0;
+		unlock(&slot_lock);
+		slot = NO_SLOT;
+	}
+
+	thread_slot = slot;
+	return slot;
+}
+
+static void shard_init(struct counter_shard *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->min = UINT64_MAX;
+}
+
+static struct counter_shard *shard_create(struct libtime_counter *c, unsigned int slot)
+{
+	struct counter_shard *s;
+
+	s = shard_alloc(sizeof(*s));
+	if (!s)
+		return NULL;
+	shard_init(s);
+	STORE_RELEASE(c->shards[slot - 1], s);
+	return s;
+}
+
+static inline void shard_update(struct counter_shard *s, uint64_t ticks)
+{
+	double delta;
+
+	s->count++;
+	s->sum += ticks;
+	if (ticks < s->min)
+		s->min = ticks;
+	if (ticks > s->max)
+		s->max = ticks;
+	delta = (double)ticks - s->mean;
+	s->mean += delta / (double)s->count;
+	s->m2 += delta * ((double)ticks - s->mean);
+}
+
+struct libtime_counter *libtime_counter_create(void)
+{
+	struct libtime_counter *c;
+
+	c = shard_alloc(sizeof(*c));
+	if (!c)
+		return NULL;
+	memset(c, 0, sizeof(*c));
+	shard_init(&c->overflow);
+	return c;
+}
+
+void libtime_counter_destroy(struct libtime_counter *c)
+{
+	unsigned int i;
+
+	if (!c)
+		return;
+	for (i = 0; i < NR_SLOTS; i++)
+		shard_free(c->shards[i]);
+	shard_free(c);
+}
+
+void libtime_counter_add(struct libtime_counter *c, uint64_t ticks)
+{
+	struct counter_shard *s = NULL;
+	unsigned int slot = thread_slot;
+	uint32_t seq;
+
+	if (!slot)
+		slot = slot_claim();
+	if (slot != NO_SLOT) {
+		s = READ_ONCE(c->shards[slot - 1]);
+		if (!s)
+			s = shard_create(c, slot);
+	}
+
+	if (!s) {
+		seq = libtime_seq_write_begin(&c->overflow.seq);
+		shard_update(&c->overflow, ticks);
+		libtime_seq_write_end(&c->overflow.seq, seq);
+		return;
+	}
+
+	/* We're the only writer, so the count needs no atomic update. */
+	seq = s->seq + 1;
+	WRITE_ONCE(s->seq, seq);
+#if defined(__GNUC__)
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+#elif defined(_MSC_VER)
+	_ReadWriteBarrier();
+#endif
+	shard_update(s, ticks);
+	libtime_seq_write_end(&s->seq, seq);
+}
+
+static void shard_read(const struct counter_shard *s, struct counter_shard *out)
+{
+	uint32_t seq;
+	do {
+		seq = _libtime_seq_begin(&s->seq);
+		out->count = s->count;
+		out->sum = s->sum;
+		out->min = s->min;
+		out->max = s->max;
+		out->mean = s->mean;
+		out->m2 = s->m2;
+	} while (_libtime_seq_retry(&s->seq, seq));
+}
+
+/* Fold 's' into 'total', combining the variances as per Chan et al. */
+static void shard_merge(struct counter_shard *total, const struct counter_shard *s)
+{
+	double n, delta;
+
+	if (!s->count)
+		return;
+	n = (double)(total->count + s->count);
+	delta = s->mean - total->mean;
+	total->mean += delta * (double)s->count / n;
+	total->m2 += s->m2 + delta * delta * (double)total->count * (double)s->count / n;
+	total->count += s->count;
+	total->sum += s->sum;
+	if (s->min < total->min)
+		total->min = s->min;
+	if (s->max > total->max)
+		total->max = s->max;
+}
+
+void libtime_counter_read(const struct libtime_counter *c, struct libtime_counter_stats *stats)
+{
+	struct counter_shard total, copy;
+	const struct counter_shard *s;
+	struct libtime_cpu_conv conv;
+	unsigned int i;
+
+	shard_init(&total);
+	shard_read(&c->overflow, &copy);
+	shard_merge(&total, &copy);
+	for (i = 0; i < NR_SLOTS; i++) {
+		s = LOAD_ACQUIRE(c->shards[i]);
+		if (s) {
+			shard_read(s, &copy);
+			shard_merge(&total, &copy);
+		}
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	if (!total.count)
+		return;
+
+	_libtime_cpu_conv_read(&conv);
+	stats->count = total.count;
+	stats->total_ns = _libtime_cpu_scale(&conv, total.sum);
+	stats->min_ns = _libtime_cpu_scale(&conv, total.min);
+	stats->max_ns = _libtime_cpu_scale(&conv, total.max);
+	stats->mean_ns = _libtime_cpu_scale(&conv, (uint64_t)llround(total.mean));
+	if (total.count > 1)
+		stats->stddev_ns = _libtime_cpu_scale(&conv,
+		                       (uint64_t)llround(sqrt(total.m2 / (double)(total.count - 1))));
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
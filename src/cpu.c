@@ -24,15 +24,7 @@
 
 #include <math.h>
 
-static uint64_t cycles_per_msec;
-static uint64_t cycles_per_msec;
-static uint64_t clock_mult;
-static uint64_t max_cycles_mask;
-static uint64_t nsecs_for_max_cycles;
-static uint32_t clock_shift;
-static uint32_t max_cycles_shift;
-static uint64_t max_ticks;
-#define MAX_CLOCK_SEC 60*60
+struct libtime_cpu_conv _libtime_cpu_conv;
 
 #ifdef _DEBUG
 #include <stdio.h>
@@ -43,6 +35,18 @@ static inline void dprint(const char *format, ...) { }
 
 #ifdef _MSC_VER
 #include <intrin.h>
+#endif
+
+#if defined(TARGET_OS_LINUX) && (defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64))
+#define USE_PERF_USERPAGE
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
 static inline double fmax(double l, double r)
 {
 	return (l > r) ? l : r;
@@ -51,22 +55,6 @@ static inline double fmin(double l, double r)
 {
 	return (l < r) ? l : r;
 }
-
-static inline int __builtin_clzll( unsigned long long input_num ) {
-	unsigned long index;
-#ifdef _WIN64
-	_BitScanReverse64( &index, input_num );
-#else
-	if ( input_num > 0xFFFFFFFF ) {
-		_BitScanReverse( &index, ( uint32_t )( input_num >> 32 ) );
-		index += 32;
-	}
-	else {
-		_BitScanReverse( &index, ( uint32_t )( input_num ) );
-	}
-#endif
-	return 63 - index;
-}
 #endif
 #define min(x, y) ((x > y) ? y : x)
 #define max(x, y) ((x > y) ? x : y)
@@ -91,14 +79,79 @@ static uint64_t get_cycles_per_msec(void)
     return (c_e - c_s) * 1000000 / elapsed;
 }
 
+int libtime_cpuid_tsc_rate(const uint32_t *leaf15, uint32_t leaf16_eax,
+                           uint64_t *cycles, uint64_t *nsecs)
+{
+	/*
+	 * Leaf 0x15 gives the TSC/crystal ratio in EBX/EAX and the crystal
+	 * frequency in ECX, if it's known. Keep the ratio as it is, since
+	 * the division needn't come out even.
+	 */
+	if (leaf15 && leaf15[0] && leaf15[1] && leaf15[2]) {
+		*cycles = (uint64_t)leaf15[2] * leaf15[1];
+		*nsecs = (uint64_t)leaf15[0] * 1000000000ULL;
+		return 1;
+	}
+
+	/*
+	 * Leaf 0x16 gives the processor base frequency in MHz. On parts which
+	 * don't report their crystal frequency that's close to the TSC rate,
+	 * but commonly off by a few tenths of a percent.
+	 */
+	*cycles = (uint64_t)(leaf16_eax & 0xffff) * 1000000ULL;
+	*nsecs = *cycles ? 1000000000ULL : 0;
+	return 0;
+}
+
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+/*
+ * Ask the processor for its TSC frequency, so that we don't have to measure
+ * it. This is only trustworthy when the TSC is invariant, i.e. it ticks at a
+ * constant rate regardless of P-states and C-states.
+ */
+static int cpuid_tsc_rate(uint64_t *cycles, uint64_t *nsecs)
+{
+	uint32_t regs[4], leaf15[4] = { 0 }, leaf16_eax = 0, max_leaf;
+
+	*cycles = *nsecs = 0;
+
+	libtime_cpuid(0x80000000, 0, regs);
+	if (regs[0] < 0x80000007)
+		return 0;
+	libtime_cpuid(0x80000007, 0, regs);
+	if (!(regs[3] & (1 << 8)))
+		return 0;
+
+	libtime_cpuid(0, 0, regs);
+	max_leaf = regs[0];
+
+	if (max_leaf >= 0x15) {
+		libtime_cpuid(0x15, 0, leaf15);
+		dprint("cpuid 0x15: eax=%u, ebx=%u, ecx=%u\n", leaf15[0], leaf15[1], leaf15[2]);
+	}
+	if (max_leaf >= 0x16) {
+		libtime_cpuid(0x16, 0, regs);
+		dprint("cpuid 0x16: eax=%u\n", regs[0]);
+		leaf16_eax = regs[0];
+	}
+
+	return libtime_cpuid_tsc_rate(leaf15, leaf16_eax, cycles, nsecs);
+}
+#else
+static int cpuid_tsc_rate(uint64_t *cycles, uint64_t *nsecs)
+{
+	*cycles = *nsecs = 0;
+	return 0;
+}
+#endif
+
 #define NR_TIME_ITERS 50
 
-int libtime_init_cpuclock(void)
+static uint64_t calibrate_cycles_per_msec(void)
 {
 	double delta, mean, S;
 	uint64_t minc, maxc, avg, cycles[NR_TIME_ITERS];
-	int i, samples, sft = 0;
-	uint64_t tmp, max_mult;
+	int i, samples;
 
 	cycles[0] = get_cycles_per_msec();
 	S = delta = mean = 0.0;
@@ -116,7 +169,7 @@ int libtime_init_cpuclock(void)
 	 * indefinitely. Check for that and return failure.
 	 */
 	if (!cycles[0] && !cycles[NR_TIME_ITERS - 1])
-		return 1;
+		return 0;
 
 	S = sqrt(S / (NR_TIME_ITERS - 1.0));
 
@@ -141,92 +194,263 @@ int libtime_init_cpuclock(void)
 		dprint("cycles[%d]=%llu\n", i, (unsigned long long) cycles[i]);
 
 	avg /= samples;
-	cycles_per_msec = avg;
 	dprint("min=%llu, max=%llu, mean=%f, S=%f, N=%d\n",
 	       (unsigned long long) minc,
 	       (unsigned long long) maxc, mean, S, NR_TIME_ITERS);
 	dprint("trimmed mean=%llu, N=%d\n", (unsigned long long) avg, samples);
 
-	max_ticks = MAX_CLOCK_SEC * cycles_per_msec * 1000ULL;
-	max_mult = UINT64_MAX / max_ticks;
-	dprint("\n\nmax_ticks=%llu, __builtin_clzll=%d, "
-	       "max_mult=%llu\n", max_ticks,
-	       __builtin_clzll(max_ticks), max_mult);
+	return avg;
+}
+
+/*
+ * Find mult and shift such that (x * mult) >> shift == x * num / den, with
+ * mult normalized to use all 64 bits. This is long division of num by den,
+ * one quotient bit at a time, so that it doesn't need a 128-bit divide.
+ */
+static uint8_t fixed_point(uint64_t num, uint64_t den, uint64_t *mult)
+{
+	uint64_t q = num / den, rem = num % den, carry;
+	unsigned int shift = 0;
+
+	while (!(q >> 63) && shift < 127) {
+		carry = rem >> 63;
+		rem <<= 1;
+		q <<= 1;
+		if (carry || rem >= den) {
+			rem -= den;
+			q |= 1;
+		}
+		shift++;
+	}
+
+	/* Round to nearest on the next quotient bit */
+	carry = rem >> 63;
+	rem <<= 1;
+	if ((carry || rem >= den) && q != UINT64_MAX)
+		q++;
+
+	*mult = q;
+	return shift;
+}
+
+/* Set up conversions for a CPU clock which counts 'cycles' per 'nsecs'. */
+static void cpu_conv_init(struct libtime_cpu_conv *conv, uint64_t cycles, uint64_t nsecs)
+{
+	conv->clock_shift = fixed_point(nsecs, cycles, &conv->clock_mult);
+	conv->cycles_shift = fixed_point(cycles, nsecs, &conv->cycles_mult);
+	conv->cycles_per_msec = _libtime_wall_scale(conv, 1000000);
+
+	dprint("clock_mult=%llu, clock_shift=%u, cycles_mult=%llu, "
+	       "cycles_shift=%u\n", conv->clock_mult, conv->clock_shift,
+	       conv->cycles_mult, conv->cycles_shift);
+}
+
+#ifdef USE_PERF_USERPAGE
+/*
+ * The kernel publishes its own TSC to nanosecond conversion in the mmap page
+ * of any perf event, as ns = (cyc >> shift) * mult +
+ * (((cyc & ((1 << shift) - 1)) * mult) >> shift), which works out to
+ * (cyc * mult) >> shift. Since the ratio is exactly mult / 2^shift, our
+ * conversion reproduces the kernel's results bit for bit.
+ */
+static int perf_cpu_conv(struct libtime_cpu_conv *conv)
+{
+	struct perf_event_attr attr;
+	volatile struct perf_event_mmap_page *pc;
+	uint32_t seq, time_mult = 0;
+	uint16_t time_shift = 0;
+	int cap_user_time = 0;
+	long page_size;
+	void *page;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_DUMMY;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0)
+		return 1;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		close(fd);
+		return 1;
+	}
+
+	pc = page;
+	do {
+		seq = pc->lock;
+		__sync_synchronize();
+		cap_user_time = pc->cap_user_time;
+		time_mult = pc->time_mult;
+		time_shift = pc->time_shift;
+		__sync_synchronize();
+	} while (pc->lock != seq);
+
+	munmap(page, page_size);
+	close(fd);
+
+	dprint("perf: cap_user_time=%d, time_mult=%u, time_shift=%u\n",
+	       cap_user_time, time_mult, time_shift);
+	if (!cap_user_time || !time_mult || time_shift >= 32)
+		return 1;
+
+	cpu_conv_init(conv, 1ULL << time_shift, time_mult);
+
+	return 0;
+}
+#else
+static int perf_cpu_conv(struct libtime_cpu_conv *conv)
+{
+	return 1;
+}
+#endif
+
+void libtime_cpu_conv_publish(const struct libtime_cpu_conv *conv, int rebase)
+{
+	struct libtime_cpu_conv *dst = &_libtime_cpu_conv;
+	uint64_t base_cycles, base_nsecs;
+	uint32_t seq;
+
+	seq = libtime_seq_write_begin(&dst->seq);
 
 	/*
-	 * Find the largest shift count that will produce
-	 * a multiplier that does not exceed max_mult
+	 * When replacing live parameters, start the new rate from wherever
+	 * libtime_cpu_ns() is right now, so it doesn't jump. That includes
+	 * a second libtime_init(), which would otherwise throw away whatever
+	 * libtime_drift_start() has done to the timeline.
 	 */
-	tmp = max_mult * cycles_per_msec / 1000000;
-	while (tmp > 1) {
-		tmp >>= 1;
-		sft++;
-		dprint("tmp=%llu, sft=%u\n", tmp, sft);
+	if (rebase || dst->clock_mult) {
+		base_cycles = libtime_cpu();
+		base_nsecs = _libtime_cpu_ns_at(dst, base_cycles);
+	} else {
+		base_cycles = conv->base_cycles;
+		base_nsecs = conv->base_nsecs;
+	}
+
+	dst->clock_shift = conv->clock_shift;
+	dst->cycles_shift = conv->cycles_shift;
+	dst->clock_mult = conv->clock_mult;
+	dst->cycles_mult = conv->cycles_mult;
+	dst->cycles_per_msec = conv->cycles_per_msec;
+	dst->base_cycles = base_cycles;
+	dst->base_nsecs = base_nsecs;
+	libtime_seq_write_end(&dst->seq, seq);
+}
+
+void libtime_cpu_set_rate(uint64_t cycles, uint64_t nsecs)
+{
+	struct libtime_cpu_conv conv = { 0 };
+
+	cpu_conv_init(&conv, cycles, nsecs);
+	libtime_cpu_conv_publish(&conv, 1);
+}
+
+/* Set when the current parameters came from a single quick measurement. */
+static int cpuclock_provisional;
+
+int libtime_init_cpuclock(unsigned int flags)
+{
+	struct libtime_cpu_conv conv = { 0 };
+	uint64_t cycles = 0, nsecs = 0, cycles_per_msec, measured;
+	int exact = 0;
+
+	cpuclock_provisional = 0;
+
+	if (!(flags & LIBTIME_INIT_CALIBRATE)) {
+		if (!perf_cpu_conv(&conv)) {
+			libtime_cpu_conv_publish(&conv, 0);
+			return 0;
+		}
+		exact = cpuid_tsc_rate(&cycles, &nsecs);
 	}
 
-	clock_shift = sft;
-	clock_mult = (1ULL << sft) * 1000000 / cycles_per_msec;
-	dprint("clock_shift=%u, clock_mult=%llu\n", clock_shift,
-	       clock_mult);
+	/*
+	 * The processor-reported frequency should be exact, but a quick
+	 * measurement catches hypervisors and firmware which lie about it.
+	 */
+	if (cycles && (flags & LIBTIME_INIT_VERIFY)) {
+		cycles_per_msec = cycles / (nsecs / 1000000);
+		measured = get_cycles_per_msec();
+		dprint("cpuid cycles_per_msec=%llu, measured=%llu\n",
+		       (unsigned long long) cycles_per_msec,
+		       (unsigned long long) measured);
+		if (measured < cycles_per_msec - cycles_per_msec / 100 ||
+		    measured > cycles_per_msec + cycles_per_msec / 100)
+			cycles = 0;
+	}
 
 	/*
-	 * Find the greatest power of 2 clock ticks that is less than the
-	 * ticks in MAX_CLOCK_SEC_2STAGE
+	 * A rate from the base frequency alone is only good enough to start
+	 * with while libtime_refine_cpuclock() measures the real one.
 	 */
-	max_cycles_shift = 0;
-	max_cycles_mask = 0;
-	tmp = MAX_CLOCK_SEC * 1000ULL * cycles_per_msec;
-	dprint("tmp=%llu, max_cycles_shift=%u\n", tmp,
-	       max_cycles_shift);
-	while (tmp > 1) {
-		tmp >>= 1;
-		max_cycles_shift++;
-		dprint("tmp=%llu, max_cycles_shift=%u\n", tmp, max_cycles_shift);
+	if (cycles && !exact) {
+		if (flags & LIBTIME_INIT_ASYNC)
+			cpuclock_provisional = 1;
+		else
+			cycles = 0;
 	}
+
 	/*
-	 * if use use (1ULL << max_cycles_shift) * 1000 / cycles_per_msec
-	 * here we will have a discontinuity every
-	 * (1ULL << max_cycles_shift) cycles
+	 * In asynchronous mode, make do with one measurement for now and leave
+	 * the full calibration to libtime_refine_cpuclock().
 	 */
-	nsecs_for_max_cycles = ((1ULL << max_cycles_shift) * clock_mult)
-					>> clock_shift;
+	if (!cycles && (flags & LIBTIME_INIT_ASYNC)) {
+		cycles = get_cycles_per_msec();
+		nsecs = 1000000;
+		cpuclock_provisional = 1;
+	}
 
-	/* Use a bitmask to calculate ticks % (1ULL << max_cycles_shift) */
-	for (tmp = 0; tmp < max_cycles_shift; tmp++)
-		max_cycles_mask |= 1ULL << tmp;
+	if (!cycles) {
+		cycles = calibrate_cycles_per_msec();
+		nsecs = 1000000;
+	}
+	if (!cycles)
+		return 1;
 
-	dprint("max_cycles_shift=%u, 2^max_cycles_shift=%llu, "
-	       "nsecs_for_max_cycles=%llu, "
-	       "max_cycles_mask=%016llx\n",
-	       max_cycles_shift, (1ULL << max_cycles_shift),
-	       nsecs_for_max_cycles, max_cycles_mask);
+	cpu_conv_init(&conv, cycles, nsecs);
+	libtime_cpu_conv_publish(&conv, 0);
 
 	return 0;
 }
 
+void libtime_refine_cpuclock(void)
+{
+	uint64_t cycles_per_msec;
+
+	if (!cpuclock_provisional)
+		return;
+
+	cycles_per_msec = calibrate_cycles_per_msec();
+	if (!cycles_per_msec)
+		return;
+
+	libtime_cpu_set_rate(cycles_per_msec, 1000000);
+	cpuclock_provisional = 0;
+}
+
 uint64_t libtime_cpu_to_wall(uint64_t clock)
 {
-	uint64_t nsecs, multiples;
-	multiples = clock >> max_cycles_shift;
-	nsecs = multiples * nsecs_for_max_cycles;
-	nsecs += ((clock & max_cycles_mask) * clock_mult) >> clock_shift;
-	return nsecs;
+	return libtime_cpu_to_wall_inline(clock);
 }
 
 uint64_t libtime_wall_to_cpu(uint64_t ns)
 {
-	if (ns > max_ticks) {
-		/* Invalid, too large a value to represent properly. Safer to return
-		 * zero than a totally bogus value
-		 */
-		return 0;
-	}
-	return ns * cycles_per_msec / 1000000ULL;
+	struct libtime_cpu_conv conv;
+
+	_libtime_cpu_conv_read(&conv);
+	return _libtime_wall_scale(&conv, ns);
 }
 
 uint64_t libtime_cpu_ns(void)
 {
-	return libtime_cpu_to_wall(libtime_cpu());
+	return libtime_cpu_ns_inline();
 }
 
 /* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,248 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_internal.h"
+
+#include <math.h>
+#if defined(TARGET_OS_WINDOWS)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#endif
+
+#define DEFAULT_INTERVAL_NS 10000000000ULL
+
+/* Largest rate adjustment used to correct an offset, as a fraction. */
+#define MAX_SLEW 0.0005
+
+/* Don't trust a rate measured over less than this. */
+#define MIN_BASELINE_NS 1000000000ULL
+
+#define NR_ANCHOR_TRIES 8
+
+struct anchor {
+	uint64_t cycles;
+	uint64_t nsecs;
+};
+
+static uint64_t interval_ns;
+static struct anchor first;
+static int64_t first_offset;
+
+/*
+ * Take a (CPU clock, wall clock) pair. The wall clock read is bracketed by
+ * two CPU clock reads, and the tightest bracket out of a few tries wins, so
+ * that preemption doesn't skew the pair.
+ */
+static void take_anchor(struct anchor *a)
+{
+	uint64_t s, e, w, best = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < NR_ANCHOR_TRIES; i++) {
+		s = libtime_cpu_start();
+		w = libtime_wall();
+		e = libtime_cpu_stop(NULL);
+		if (e - s < best) {
+			best = e - s;
+			a->cycles = s + (e - s) / 2;
+			a->nsecs = w;
+		}
+	}
+}
+
+static void drift_start_baseline(void)
+{
+	struct libtime_cpu_conv conv;
+
+	take_anchor(&first);
+	_libtime_cpu_conv_read(&conv);
+	first_offset = (int64_t)(_libtime_cpu_ns_at(&conv, first.cycles) - first.nsecs);
+}
+
+/*
+ * Refine the CPU clock rate over the full baseline since we started, and
+ * fold in a bounded correction for whatever offset has built up against the
+ * wall clock, to be worked off over the next interval.
+ */
+static void drift_correct(void)
+{
+	struct libtime_cpu_conv conv;
+	struct anchor now;
+	double cycles_per_ns, slew;
+	int64_t error;
+
+	take_anchor(&now);
+	if (now.nsecs - first.nsecs < MIN_BASELINE_NS)
+		return;
+
+	cycles_per_ns = (double)(now.cycles - first.cycles) / (double)(now.nsecs - first.nsecs);
+
+	_libtime_cpu_conv_read(&conv);
+	error = (int64_t)(_libtime_cpu_ns_at(&conv, now.cycles) - now.nsecs) - first_offset;
+
+	/* Running ahead (error > 0) means nanoseconds should pass more slowly. */
+	slew = -(double)error / (double)interval_ns;
+	if (slew > MAX_SLEW)
+		slew = MAX_SLEW;
+	if (slew < -MAX_SLEW)
+		slew = -MAX_SLEW;
+
+	libtime_cpu_set_rate((uint64_t)llround(cycles_per_ns * 1000000000.0 / (1.0 + slew)),
+	                     1000000000ULL);
+}
+
+#if defined(TARGET_OS_WINDOWS)
+
+static HANDLE drift_thread;
+static HANDLE drift_stop_event;
+
+static DWORD WINAPI drift_main(LPVOID arg)
+{
+	DWORD ms = (DWORD)(interval_ns / 1000000ULL);
+
+	drift_start_baseline();
+	while (WaitForSingleObject(drift_stop_event, ms) == WAIT_TIMEOUT)
+		drift_correct();
+	return 0;
+}
+
+int libtime_drift_start(uint64_t interval)
+{
+	if (drift_thread)
+		return 1;
+	interval_ns = interval ? interval : DEFAULT_INTERVAL_NS;
+	drift_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!drift_stop_event)
+		return 1;
+	drift_thread = CreateThread(NULL, 0, drift_main, NULL, 0, NULL);
+	if (!drift_thread) {
+		CloseHandle(drift_stop_event);
+		return 1;
+	}
+	return 0;
+}
+
+void libtime_drift_stop(void)
+{
+	if (!drift_thread)
+		return;
+	SetEvent(drift_stop_event);
+	WaitForSingleObject(drift_thread, INFINITE);
+	CloseHandle(drift_thread);
+	CloseHandle(drift_stop_event);
+	drift_thread = NULL;
+}
+
+#else
+
+static pthread_t drift_thread;
+static pthread_mutex_t drift_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drift_cond;
+static pthread_once_t drift_cond_once = PTHREAD_ONCE_INIT;
+static int drift_running;
+static int drift_stopping;
+
+/*
+ * Time the interval on CLOCK_MONOTONIC, so that the wall clock being stepped
+ * doesn't stretch or cut short the slew. macOS has no clock attribute for
+ * condition variables, but its relative waits aren't affected by steps.
+ */
+static void drift_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+#if !defined(TARGET_OS_MACOSX)
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&drift_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void *drift_main(void *arg)
+{
+	struct timespec deadline;
+	int r;
+
+	drift_start_baseline();
+
+	pthread_mutex_lock(&drift_lock);
+	while (!drift_stopping) {
+#if defined(TARGET_OS_MACOSX)
+		deadline.tv_sec = interval_ns / 1000000000ULL;
+		deadline.tv_nsec = interval_ns % 1000000000ULL;
+		do {
+			r = pthread_cond_timedwait_relative_np(&drift_cond, &drift_lock, &deadline);
+		} while (r == 0 && !drift_stopping);
+#else
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += interval_ns / 1000000000ULL;
+		deadline.tv_nsec += interval_ns % 1000000000ULL;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		do {
+			r = pthread_cond_timedwait(&drift_cond, &drift_lock, &deadline);
+		} while (r == 0 && !drift_stopping);
+#endif
+		if (drift_stopping)
+			break;
+
+		pthread_mutex_unlock(&drift_lock);
+		drift_correct();
+		pthread_mutex_lock(&drift_lock);
+	}
+	pthread_mutex_unlock(&drift_lock);
+	return NULL;
+}
+
+int libtime_drift_start(uint64_t interval)
+{
+	if (drift_running)
+		return 1;
+	interval_ns = interval ? interval : DEFAULT_INTERVAL_NS;
+	pthread_once(&drift_cond_once, drift_cond_init);
+	drift_stopping = 0;
+	if (pthread_create(&drift_thread, NULL, drift_main, NULL))
+		return 1;
+	drift_running = 1;
+	return 0;
+}
+
+void libtime_drift_stop(void)
+{
+	if (!drift_running)
+		return;
+	pthread_mutex_lock(&drift_lock);
+	drift_stopping = 1;
+	pthread_cond_signal(&drift_cond);
+	pthread_mutex_unlock(&drift_lock);
+	pthread_join(drift_thread, NULL);
+	drift_running = 0;
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,178 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_hist.h"
+#include "libtime_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_MAX_NS (3600ULL * 1000000000ULL)
+#define MIN_DIGITS 1
+#define MAX_DIGITS 5
+
+/* The lowest and highest values that share a counts[] entry */
+static uint64_t index_lowest(const struct libtime_hist *h, uint32_t i)
+{
+	uint32_t b, half = 1U << h->sub_bucket_bits;
+
+	if (i < 2 * half)
+		return i;
+	b = (i >> h->sub_bucket_bits) - 1;
+	return (uint64_t)(i - (b << h->sub_bucket_bits)) << b;
+}
+
+static uint64_t index_highest(const struct libtime_hist *h, uint32_t i)
+{
+	uint32_t b;
+
+	if (i < 2U << h->sub_bucket_bits)
+		return i;
+	b = (i >> h->sub_bucket_bits) - 1;
+	return index_lowest(h, i) + (1ULL << b) - 1;
+}
+
+struct libtime_hist *libtime_hist_create(uint64_t max_ns, int digits)
+{
+	struct libtime_hist *h;
+	uint64_t sub_buckets = 2;
+	unsigned int bits = 1;
+	int i;
+
+	if (digits < MIN_DIGITS || digits > MAX_DIGITS)
+		return NULL;
+	if (!max_ns)
+		max_ns = DEFAULT_MAX_NS;
+
+	/* Enough sub-buckets to tell apart values 1 in 10^digits apart, at
+	 * the bottom of each power of two range (which holds half of them).
+	 */
+	for (i = 0; i < digits; i++)
+		sub_buckets *= 10;
+	while ((1ULL << bits) < sub_buckets)
+		bits++;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return NULL;
+	h->sub_bucket_bits = bits - 1;
+	h->sub_bucket_mask = (1ULL << bits) - 1;
+	h->max = libtime_wall_to_cpu(max_ns);
+	if (h->max < h->sub_bucket_mask)
+		h->max = h->sub_bucket_mask;
+	h->len = _libtime_hist_index(h, h->max) + 1;
+	h->counts = calloc(h->len, sizeof(uint64_t));
+	if (!h->counts) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+void libtime_hist_destroy(struct libtime_hist *h)
+{
+	if (!h)
+		return;
+	free(h->counts);
+	free(h);
+}
+
+void libtime_hist_reset(struct libtime_hist *h)
+{
+	memset(h->counts, 0, h->len * sizeof(uint64_t));
+}
+
+int libtime_hist_merge(struct libtime_hist *dst, const struct libtime_hist *src)
+{
+	uint32_t i, last = dst->len - 1;
+
+	if (dst->sub_bucket_bits != src->sub_bucket_bits)
+		return 1;
+
+	/* Same digits means the same bucket layout; only the range can differ. */
+	for (i = 0; i < src->len; i++)
+		dst->counts[i < last ? i : last] += READ_ONCE(src->counts[i]);
+	return 0;
+}
+
+uint64_t libtime_hist_count(const struct libtime_hist *h)
+{
+	uint64_t total = 0;
+	uint32_t i;
+
+	for (i = 0; i < h->len; i++)
+		total += READ_ONCE(h->counts[i]);
+	return total;
+}
+
+uint64_t libtime_hist_percentile(const struct libtime_hist *h, double percentile)
+{
+	struct libtime_cpu_conv conv;
+	uint64_t total, target, seen = 0;
+	uint32_t i;
+
+	total = libtime_hist_count(h);
+	if (!total)
+		return 0;
+
+	if (percentile < 0.0)
+		percentile = 0.0;
+	if (percentile > 100.0)
+		percentile = 100.0;
+	target = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+	if (target < 1)
+		target = 1;
+	if (target > total)
+		target = total;
+
+	_libtime_cpu_conv_read(&conv);
+	for (i = 0; i < h->len; i++) {
+		seen += READ_ONCE(h->counts[i]);
+		if (seen >= target)
+			return _libtime_cpu_scale(&conv, index_highest(h, i));
+	}
+
+	/* Counts went up while we were looking; the top is close enough. */
+	return _libtime_cpu_scale(&conv, h->max);
+}
+
+uint64_t libtime_hist_mean(const struct libtime_hist *h)
+{
+	struct libtime_cpu_conv conv;
+	double sum = 0.0, total = 0.0, n;
+	uint32_t i;
+
+	for (i = 0; i < h->len; i++) {
+		n = (double)READ_ONCE(h->counts[i]);
+		if (n == 0.0)
+			continue;
+		sum += n * (double)(index_lowest(h, i) + index_highest(h, i)) / 2.0;
+		total += n;
+	}
+	if (total == 0.0)
+		return 0;
+
+	_libtime_cpu_conv_read(&conv);
+	return _libtime_cpu_scale(&conv, (uint64_t)(sum / total + 0.5));
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -22,28 +22,260 @@
 #include "libtime.h"
 #include "libtime_internal.h"
 
+#include <stdlib.h>
+#include <string.h>
+#if defined(TARGET_OS_WINDOWS)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 clock_pfn _libtime_clocks[CLOCK_TYPE_MAX + 1];
+uint8_t _libtime_sources[CLOCK_TYPE_MAX + 1];
+
+static const clock_pfn source_clocks[] = {
+	libtime_cpu_ns,     /* CLOCK_SOURCE_CPU */
+	libtime_wall,       /* CLOCK_SOURCE_WALL */
+	libtime_wall_fast,  /* CLOCK_SOURCE_WALL_FAST */
+};
+
+static struct libtime_clock_info source_info[ELEM_SIZE(source_clocks)];
+
+static void set_clock(ClockType type, ClockSource source)
+{
+	_libtime_sources[type] = source;
+	_libtime_clocks[type] = source_clocks[source];
+}
+
+#define MEASURE_RUNS 63
+#define MEASURE_READS 16
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void libtime_clock_measure(clock_read_fn read, const void *arg, struct libtime_clock_info *info)
+{
+	uint64_t runs[MEASURE_RUNS], s, e, v, last;
+	int i, j;
+
+	info->backwards = 0;
+	last = read(arg);
+	for (i = 0; i < MEASURE_RUNS; i++) {
+		s = libtime_cpu_start();
+		for (j = 0; j < MEASURE_READS; j++) {
+			v = read(arg);
+			if (v < last)
+				info->backwards++;
+			last = v;
+		}
+		e = libtime_cpu_stop(NULL);
+		runs[i] = (e - s) / MEASURE_READS;
+	}
+
+	qsort(runs, MEASURE_RUNS, sizeof(runs[0]), compare_u64);
+	info->cost_min = runs[0];
+	info->cost_median = runs[MEASURE_RUNS / 2];
+}
+
+static uint64_t read_source(const void *arg)
+{
+	return (*(const clock_pfn *)arg)();
+}
+
+static void measure_cpu_source(void)
+{
+	struct libtime_clock_info *info = &source_info[CLOCK_SOURCE_CPU];
+	uint64_t cycles_per_msec = _libtime_cpu_conv.cycles_per_msec;
+
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+	info->name = "TSC";
+#else
+	info->name = "CPU clock";
+#endif
+	info->resolution_ns = cycles_per_msec >= 1000000 ? 1 :
+	                      (1000000 + cycles_per_msec - 1) / cycles_per_msec;
+	libtime_clock_measure(read_source, &source_clocks[CLOCK_SOURCE_CPU], info);
+}
+
+/*
+ * Take the cheapest clock with a fine resolution for CLOCK_FAST, unless a
+ * coarse one is several times cheaper still. That way the coarse clocks
+ * only win where the others are slow, such as a hypervisor trapping RDTSC.
+ */
+static ClockSource select_fast(int cpuclock_ok)
+{
+	static const ClockSource order[] = {
+		CLOCK_SOURCE_CPU, CLOCK_SOURCE_WALL, CLOCK_SOURCE_WALL_FAST,
+	};
+	const struct libtime_clock_info *info, *fine = NULL, *coarse = NULL;
+	ClockSource fine_source = CLOCK_SOURCE_WALL, coarse_source = CLOCK_SOURCE_WALL_FAST;
+	size_t i;
+
+	for (i = 0; i < ELEM_SIZE(order); i++) {
+		info = &source_info[order[i]];
+		if (order[i] == CLOCK_SOURCE_CPU && (!cpuclock_ok || info->backwards))
+			continue;
+		if (info->resolution_ns <= FINE_RESOLUTION_NS) {
+			if (!fine || libtime_clock_cheaper(info, fine)) {
+				fine = info;
+				fine_source = order[i];
+			}
+		} else if (!coarse || libtime_clock_cheaper(info, coarse)) {
+			coarse = info;
+			coarse_source = order[i];
+		}
+	}
+
+	if (!fine || (coarse && coarse->cost_median * 4 <= fine->cost_median))
+		return coarse_source;
+	return fine_source;
+}
+
+const struct libtime_clock_info *libtime_clock_info(ClockType type)
+{
+	if ((unsigned int)type > CLOCK_TYPE_MAX)
+		return NULL;
+	return &source_info[_libtime_sources[type]];
+}
+
+static unsigned int init_flags;
+
+static void save_calibration(void)
+{
+	struct libtime_calibration cal;
+
+	memset(&cal, 0, sizeof(cal));
+	_libtime_cpu_conv_read(&cal.cpu);
+
+	/* Only the rate carries over. A process loading it starts its
+	 * libtime_cpu_ns() timeline from zero, the same as a cold init.
+	 */
+	cal.cpu.base_cycles = 0;
+	cal.cpu.base_nsecs = 0;
+	libtime_sleep_calibration(&cal);
+	libtime_cache_store(&cal);
+}
+
+/*
+ * Replace the provisional results from an asynchronous libtime_init() with
+ * fully calibrated ones. Conversions keep working throughout, since the new
+ * parameters are published atomically.
+ */
+static void refine_calibration(void)
+{
+	libtime_refine_cpuclock();
+	libtime_refine_sleep();
+	if (init_flags & LIBTIME_INIT_CACHE)
+		save_calibration();
+}
+
+#if defined(TARGET_OS_WINDOWS)
+static HANDLE calibration_thread;
+
+static DWORD WINAPI calibration_main(LPVOID arg)
+{
+	refine_calibration();
+	return 0;
+}
+
+static int start_calibration_thread(void)
+{
+	calibration_thread = CreateThread(NULL, 0, calibration_main, NULL, 0, NULL);
+	return calibration_thread ? 0 : 1;
+}
+
+void libtime_init_wait(void)
+{
+	if (!calibration_thread)
+		return;
+	WaitForSingleObject(calibration_thread, INFINITE);
+	CloseHandle(calibration_thread);
+	calibration_thread = NULL;
+}
+#else
+static pthread_t calibration_thread;
+static int calibration_running;
+
+static void *calibration_main(void *arg)
+{
+	refine_calibration();
+	return NULL;
+}
+
+static int start_calibration_thread(void)
+{
+	if (pthread_create(&calibration_thread, NULL, calibration_main, NULL))
+		return 1;
+	calibration_running = 1;
+	return 0;
+}
+
+void libtime_init_wait(void)
+{
+	if (!calibration_running)
+		return;
+	pthread_join(calibration_thread, NULL);
+	calibration_running = 0;
+}
+#endif
 
 void libtime_init(void)
 {
+	libtime_init_flags(0);
+}
+
+void libtime_init_flags(unsigned int flags)
+{
+	struct libtime_calibration cal;
+	int cached = 0, cpuclock_ok;
+
+	/* Don't race an earlier asynchronous calibration. */
+	libtime_init_wait();
+	init_flags = flags;
+
 	/* Safe defaults */
-	_libtime_clocks[CLOCK_CPU] = libtime_cpu_ns;
-	_libtime_clocks[CLOCK_WALL] = libtime_wall;
-	_libtime_clocks[CLOCK_WALL_FAST] = libtime_wall_fast;
-	_libtime_clocks[CLOCK_FAST] = libtime_wall_fast;
-	_libtime_clocks[CLOCK_PRECISE] = libtime_wall;
+	set_clock(CLOCK_CPU, CLOCK_SOURCE_CPU);
+	set_clock(CLOCK_WALL, CLOCK_SOURCE_WALL);
+	set_clock(CLOCK_WALL_FAST, CLOCK_SOURCE_WALL_FAST);
+	set_clock(CLOCK_FAST, CLOCK_SOURCE_WALL_FAST);
+	set_clock(CLOCK_PRECISE, CLOCK_SOURCE_WALL);
 
 	libtime_init_wallclock();
+	libtime_wallclock_info(&source_info[CLOCK_SOURCE_WALL],
+	                       &source_info[CLOCK_SOURCE_WALL_FAST]);
+
+	if ((flags & LIBTIME_INIT_CACHE) && !libtime_cache_load(&cal)) {
+		libtime_cpu_conv_publish(&cal.cpu, 0);
+		cached = 1;
+		cpuclock_ok = 1;
+	} else {
+		cpuclock_ok = !libtime_init_cpuclock(flags);
+	}
 
-	/* If we can use the CPU clock, then it should replace CLOCK_FAST. If not,
-	 * we should replace CLOCK_CPU with CLOCK_WALL
+	/* If we can use the CPU clock, then it's a candidate for CLOCK_FAST. If
+	 * not, we should replace CLOCK_CPU with CLOCK_WALL
 	 */
-	if (!libtime_init_cpuclock())
-		_libtime_clocks[CLOCK_FAST] = _libtime_clocks[CLOCK_CPU];
+	if (cpuclock_ok)
+		measure_cpu_source();
 	else
-		_libtime_clocks[CLOCK_CPU] = _libtime_clocks[CLOCK_WALL];
+		set_clock(CLOCK_CPU, CLOCK_SOURCE_WALL);
+	set_clock(CLOCK_FAST, select_fast(cpuclock_ok));
+
+	libtime_init_sleep(flags, cached ? &cal : NULL);
+
+	if (cached || !cpuclock_ok)
+		return;
 
-	libtime_init_sleep();
+	/* Only a full, working CPU clock calibration is worth saving. */
+	if (flags & LIBTIME_INIT_ASYNC) {
+		if (start_calibration_thread())
+			refine_calibration();
+	} else if (flags & LIBTIME_INIT_CACHE) {
+		save_calibration();
+	}
 }
 
 /* vim: set ts=4 sw=4 noai noet: */
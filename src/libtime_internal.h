@@ -23,6 +23,9 @@
 #include "platform.h"
 
 #include <time.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #if defined(TARGET_OS_MACOSX)
 #define USE_MACH_CLOCKS
@@ -36,12 +39,194 @@
 
 #define ELEM_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
+#if defined(__GNUC__)
+#define READ_ONCE(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define LOAD_ACQUIRE(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define READ_ONCE(x)        (x)
+#define WRITE_ONCE(x, v)    ((x) = (v))
+#define LOAD_ACQUIRE(x)     (x)
+#define STORE_RELEASE(x, v) ((x) = (v))
+#endif
+
+/* Sequence count write side; see _libtime_seq_begin() for the read side.
+ * Writers are serialized against each other by claiming the odd count.
+ */
+static inline uint32_t libtime_seq_write_begin(uint32_t *seq)
+{
+	uint32_t s;
+#if defined(__GNUC__)
+	do {
+		s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+	} while ((s & 1) || !__atomic_compare_exchange_n(seq, &s, s + 1, 0,
+	                                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+#elif defined(_MSC_VER)
+	do {
+		s = *(volatile uint32_t *)seq;
+	} while ((s & 1) || (uint32_t)_InterlockedCompareExchange((volatile long *)seq, s + 1, s) != s);
+#else
+	s = (*seq)++;
+#endif
+	return s + 1;
+}
+
+static inline void libtime_seq_write_end(uint32_t *seq, uint32_t s)
+{
+#if defined(__GNUC__)
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELEASE);
+#elif defined(_MSC_VER)
+	_ReadWriteBarrier();
+	*(volatile uint32_t *)seq = s + 1;
+#else
+	*seq = s + 1;
+#endif
+}
+
+#if defined(_MSC_VER)
+#define LIBTIME_THREAD_LOCAL __declspec(thread)
+#else
+#define LIBTIME_THREAD_LOCAL __thread
+#endif
+
+/* Tell the processor that we're in a spin-wait loop. */
+static inline void libtime_cpu_relax(void)
+{
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+#  if defined(_MSC_VER)
+	_mm_pause();
+#  else
+	__asm__ __volatile__("pause" ::: "memory");
+#  endif
+#elif defined(__GNUC__) && defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+#ifndef _MSC_VER
+#include <cpuid.h>
+#endif
+static inline void libtime_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int *)regs, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+#endif
+
 #include "libtime_begin.h"
 
-extern LIBTIME_DLL_LOCAL int libtime_init_cpuclock(void);
-extern LIBTIME_DLL_LOCAL int libtime_init_sleep(void);
+/* Calibration results, as saved and restored by the calibration cache. */
+struct libtime_calibration {
+	struct libtime_cpu_conv cpu;
+	int64_t max_sleep_ns;
+	uint64_t sleep_overhead_clk;
+};
+
+extern LIBTIME_DLL_LOCAL int libtime_init_cpuclock(unsigned int flags);
+extern LIBTIME_DLL_LOCAL int libtime_init_sleep(unsigned int flags, const struct libtime_calibration *cached);
 extern LIBTIME_DLL_LOCAL int libtime_init_wallclock(void);
 
+/* Clocks with a resolution coarser than this aren't used for CLOCK_WALL. */
+#define FINE_RESOLUTION_NS 1000
+
+/* Fill in the read cost and backwards steps in 'info' for a clock read by
+ * calling 'read' with 'arg'.
+ */
+typedef uint64_t (*clock_read_fn)(const void *arg);
+extern LIBTIME_DLL_LOCAL void libtime_clock_measure(clock_read_fn read, const void *arg,
+                                                    struct libtime_clock_info *info);
+
+/* Whether 'a' is cheaper to read than 'b' by a margin, so that noise
+ * doesn't decide between clocks of the same cost.
+ */
+static inline int libtime_clock_cheaper(const struct libtime_clock_info *a,
+                                        const struct libtime_clock_info *b)
+{
+	return a->cost_median * 10 < b->cost_median * 9;
+}
+
+/* Describe the clocks behind libtime_wall() and libtime_wall_fast(). */
+extern LIBTIME_DLL_LOCAL void libtime_wallclock_info(struct libtime_clock_info *wall,
+                                                     struct libtime_clock_info *wall_fast);
+
+extern LIBTIME_DLL_LOCAL void libtime_cpu_conv_publish(const struct libtime_cpu_conv *conv, int rebase);
+extern LIBTIME_DLL_LOCAL void libtime_cpu_set_rate(uint64_t cycles, uint64_t nsecs);
+
+/* Decode the TSC rate from CPUID leaf 0x15 (EAX to EDX, or NULL) and leaf
+ * 0x16 (EAX) as '*cycles' per '*nsecs', both 0 if neither has it. Returns 1
+ * if leaf 0x15 gave the full ratio and the crystal frequency, so the rate is
+ * exact, and 0 if it is approximate.
+ */
+extern LIBTIME_DLL_LOCAL int libtime_cpuid_tsc_rate(const uint32_t *leaf15, uint32_t leaf16_eax,
+                                                    uint64_t *cycles, uint64_t *nsecs);
+extern LIBTIME_DLL_LOCAL void libtime_refine_cpuclock(void);
+extern LIBTIME_DLL_LOCAL void libtime_refine_sleep(void);
+
+/* Kernels behind libtime_cpu_to_wall_batch() and libtime_wall_to_cpu_batch().
+ * LIBTIME_BATCH_AUTO picks the fastest one the CPU supports.
+ */
+enum libtime_batch_kernel {
+	LIBTIME_BATCH_AUTO,
+	LIBTIME_BATCH_SCALAR,
+	LIBTIME_BATCH_AVX2,
+	LIBTIME_BATCH_AVX512,
+};
+
+/* Use 'which' for batch conversions from now on, so that tests can compare
+ * each kernel against the scalar conversion. Returns 0 on success, non-zero
+ * if this build or CPU can't run it.
+ */
+extern LIBTIME_DLL_LOCAL int libtime_batch_set_kernel(enum libtime_batch_kernel which);
+
+extern LIBTIME_DLL_LOCAL void libtime_sleep_calibration(struct libtime_calibration *cal);
+
+/* Sleep and then spin until the CPU clock reaches 'deadline', the same way
+ * libtime_nanosleep() does. Returns the CPU clock value at wakeup.
+ */
+extern LIBTIME_DLL_LOCAL uint64_t libtime_wait_until(uint64_t deadline);
+
+/* Measured cost of entering and leaving libtime_nanosleep(), in CPU clock
+ * cycles.
+ */
+extern LIBTIME_DLL_LOCAL uint64_t libtime_sleep_overhead(void);
+
+#define LIBTIME_CACHE_MAGIC   0x4354544cU /* "LTTC" */
+#define LIBTIME_CACHE_VERSION 5
+
+/*
+ * The calibration results are only valid for the machine and boot they were
+ * measured on, so the file carries everything identifying those. Anything
+ * which doesn't match exactly is treated as stale.
+ */
+struct libtime_cache_key {
+	char boot_id[40];
+	char cpu_model[48];
+	uint32_t cpu_signature;
+	uint32_t tsc_flags;     /* CPUID TSC, RDTSCP and invariant TSC bits */
+};
+
+struct libtime_cache_file {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t reserved;
+	struct libtime_cache_key key;
+	struct libtime_calibration cal;
+	uint64_t checksum;
+};
+
+/* Fill in the key for this machine and boot. Returns 0 on success. */
+extern LIBTIME_DLL_LOCAL int libtime_cache_key(struct libtime_cache_key *key);
+extern LIBTIME_DLL_LOCAL uint64_t libtime_cache_checksum(const struct libtime_cache_file *file);
+
+extern LIBTIME_DLL_LOCAL int libtime_cache_load(struct libtime_calibration *cal);
+extern LIBTIME_DLL_LOCAL void libtime_cache_store(const struct libtime_calibration *cal);
+
 #include "libtime_end.h"
 
 /* vim: set ts=4 sw=4 noai noet: */
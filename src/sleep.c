@@ -32,11 +32,59 @@
 #elif defined(USE_POSIX_CLOCKS)
 #include <errno.h>
 #endif
+#if defined(TARGET_OS_LINUX)
+#include <sys/prctl.h>
+#endif
 #include <time.h>
 #include <math.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64))
+#define HAVE_TPAUSE
+#endif
+
+/* Longest run of PAUSEs between clock reads in SPIN_PAUSE mode */
+#define MAX_PAUSES 64
 
 static int64_t max_sleep_ns;
 static uint64_t sleep_overhead_clk;
+
+static uint8_t spin_mode;
+static int64_t spin_budget_ns;
+static int have_waitpkg;
+
+struct spin_stats {
+	uint64_t spins;
+	uint64_t spin_clk;
+	uint64_t max_spin_clk;
+	uint64_t late_clk;
+};
+static LIBTIME_THREAD_LOCAL struct spin_stats spin_stats;
+
+/*
+ * A thread's running estimate of how late its system sleeps wake up, kept
+ * the way TCP estimates round trip times: a mean and mean deviation, with
+ * gains of 1/8 and 1/4, stored scaled up by those factors.
+ */
+struct sleep_model {
+	int enabled;
+	uint64_t samples;
+	uint64_t mean8;
+	uint64_t dev4;
+};
+static LIBTIME_THREAD_LOCAL struct sleep_model sleep_model;
+
+/*
+ * The worst-case system sleep depends on the thread's timer slack, so a
+ * thread which changes its slack through libtime_set_timer_slack() gets its
+ * own measurement in place of the global one.
+ */
+struct thread_sleep {
+	int calibrated;
+	int64_t max_sleep_ns;
+};
+static LIBTIME_THREAD_LOCAL struct thread_sleep thread_sleep;
+
 #if defined(USE_POSIX_CLOCKS)
 static const clockid_t clock_sources[] = {
 #ifdef CLOCK_MONOTONIC_RAW
@@ -50,15 +98,15 @@ static const clockid_t clock_sources[] = {
 static clockid_t clock_id;
 #endif
 
-static inline int _libtime_nanosleep(void)
+static inline int _libtime_nanosleep(uint64_t ns)
 {
 #if defined(USE_WINDOWS_CLOCKS)
-	Sleep(1);
+	Sleep(ns >= 2000000 ? (DWORD)(ns / 1000000) : 1);
 	return 0;
 #else
 	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 0;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
 #if defined(USE_MACH_CLOCKS) || defined(TARGET_OS_FREEBSD)
 	return nanosleep(&ts, NULL);
 #elif defined(USE_POSIX_CLOCKS)
@@ -69,6 +117,95 @@ static inline int _libtime_nanosleep(void)
 #endif
 }
 
+#ifdef HAVE_TPAUSE
+/*
+ * TPAUSE in the C0.1 state, which wakes faster than C0.2, until the TSC
+ * reaches 'deadline' (or the OS-imposed limit on the wait expires). Spelled
+ * out as bytes for the benefit of older assemblers.
+ */
+static inline void tpause(uint64_t deadline)
+{
+	__asm__ __volatile__(".byte 0x66, 0x0f, 0xae, 0xf1"
+	                     :: "c" (1), "a" ((uint32_t)deadline), "d" ((uint32_t)(deadline >> 32))
+	                     : "memory", "cc");
+}
+
+static int detect_waitpkg(void)
+{
+	uint32_t regs[4];
+
+	libtime_cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return 0;
+	libtime_cpuid(7, 0, regs);
+	return (regs[2] >> 5) & 1;
+}
+#else
+static int detect_waitpkg(void)
+{
+	return 0;
+}
+#endif
+
+/*
+ * Wait until the CPU clock reaches 'deadline', starting from 'now'. Returns
+ * the CPU clock value at wakeup.
+ */
+static uint64_t spin_until(uint64_t now, uint64_t deadline)
+{
+	struct spin_stats *stats = &spin_stats;
+	uint64_t start = now, elapsed;
+	unsigned int pauses = 1, i;
+	int mode;
+
+	if (now >= deadline)
+		return now;
+
+	mode = READ_ONCE(spin_mode);
+	if (mode == SPIN_AUTO || mode == SPIN_TPAUSE)
+		mode = have_waitpkg ? SPIN_TPAUSE : SPIN_PAUSE;
+
+	switch (mode) {
+	case SPIN_BUSY:
+		while ((now = libtime_cpu()) < deadline)
+			;
+		break;
+#ifdef HAVE_TPAUSE
+	case SPIN_TPAUSE:
+		do {
+			tpause(deadline);
+		} while ((now = libtime_cpu()) < deadline);
+		break;
+#endif
+	default:
+		/*
+		 * Double the PAUSEs between clock reads while the deadline is
+		 * well beyond the last batch, and halve them as it gets close.
+		 */
+		while (now < deadline) {
+			for (i = 0; i < pauses; i++)
+				libtime_cpu_relax();
+			elapsed = libtime_cpu() - now;
+			now += elapsed;
+			if (now < deadline && deadline - now > 4 * elapsed) {
+				if (pauses < MAX_PAUSES)
+					pauses <<= 1;
+			} else if (pauses > 1) {
+				pauses >>= 1;
+			}
+		}
+		break;
+	}
+
+	elapsed = now - start;
+	stats->spins++;
+	stats->spin_clk += elapsed;
+	stats->late_clk += now - deadline;
+	if (elapsed > stats->max_spin_clk)
+		stats->max_spin_clk = elapsed;
+	return now;
+}
+
 static void _libtime_select_clocksource(void)
 {
 #if defined(USE_POSIX_CLOCKS)
@@ -79,7 +216,7 @@ static void _libtime_select_clocksource(void)
 	for (int i = 0; i < ELEM_SIZE(clock_sources); i++) {
 		clock_id = clock_sources[i];
 retry:
-		if (_libtime_nanosleep() == 0) {
+		if (_libtime_nanosleep(0) == 0) {
 			/* Success! */
 			return;
 		} else {
@@ -96,17 +233,15 @@ retry:
 #endif
 }
 
-int libtime_init_sleep(void)
+/*
+ * Estimate the worst-case time consumed by a nanosleep(0) on the calling
+ * thread.
+ */
+static int64_t measure_max_sleep(int quick)
 {
 	uint32_t i, j;
 	uint32_t samples, runs, shift;
-	uint64_t s, e, min, max;
-
-	_libtime_select_clocksource();
-
-#if defined(USE_WINDOWS_CLOCKS)
-	timeBeginPeriod(1);
-#endif
+	uint64_t s, e, max;
 
 	runs = 10;
 	samples = 128;
@@ -117,7 +252,7 @@ int libtime_init_sleep(void)
 	 * samples or else the latency for libtime_init() will be very high.
 	 */
 	s = libtime_cpu();
-	_libtime_nanosleep();
+	_libtime_nanosleep(0);
 	e = libtime_cpu();
 	if (libtime_cpu_to_wall(e - s) > 1000000) {
 		/*
@@ -130,25 +265,40 @@ int libtime_init_sleep(void)
 	}
 
 	/*
-	 * Estimate the worst-case time consumed by a nanosleep(0).
+	 * For a provisional estimate, a handful of samples will have to do.
 	 */
+	if (quick) {
+		runs = 1;
+		samples = 4;
+		shift = 2;
+	}
+
 	max = 0;
 	for (j = 0; j < runs; j++) {
 		s = libtime_cpu();
 		for (i = 0; i < samples; i++) {
-			_libtime_nanosleep();
+			_libtime_nanosleep(0);
 		}
 		e = libtime_cpu();
 		if ((e - s) > max)
 			max = (e - s);
 	}
-	max_sleep_ns = libtime_cpu_to_wall((max + samples - 1) >> shift);
+	return libtime_cpu_to_wall((max + samples - 1) >> shift);
+}
+
+static void calibrate_sleep(int quick)
+{
+	uint32_t i, j;
+	uint32_t samples, runs, shift;
+	uint64_t s, e, min;
+
+	WRITE_ONCE(max_sleep_ns, measure_max_sleep(quick));
 
 	/*
 	 * Estimate the minimum time consumed by calling our libtime_nanosleep()
 	 * API.
 	 */
-	runs = 10;
+	runs = quick ? 1 : 10;
 	samples = 128;
 	shift = 7;
 
@@ -162,35 +312,257 @@ int libtime_init_sleep(void)
 		if ((e - s) < min)
 			min = (e - s);
 	}
-	sleep_overhead_clk = (min + samples - 1) >> shift;
+	WRITE_ONCE(sleep_overhead_clk, (min + samples - 1) >> shift);
+}
 
+static int set_timer_slack(uint64_t slack_ns, int quick)
+{
+#if defined(TARGET_OS_LINUX)
+	/* A slack of 0 asks prctl() for the thread's default. */
+	if (prctl(PR_SET_TIMERSLACK, (unsigned long)slack_ns, 0, 0, 0))
+		return 1;
+	if (!slack_ns) {
+		thread_sleep.calibrated = 0;
+		return 0;
+	}
+	thread_sleep.max_sleep_ns = measure_max_sleep(quick);
+	thread_sleep.calibrated = 1;
 	return 0;
+#else
+	return 1;
+#endif
+}
+
+int libtime_init_sleep(unsigned int flags, const struct libtime_calibration *cached)
+{
+	_libtime_select_clocksource();
+	have_waitpkg = detect_waitpkg();
+
+#if defined(USE_WINDOWS_CLOCKS)
+	timeBeginPeriod(1);
+#endif
+
+	if (cached) {
+		max_sleep_ns = cached->max_sleep_ns;
+		sleep_overhead_clk = cached->sleep_overhead_clk;
+	} else {
+		calibrate_sleep(flags & LIBTIME_INIT_ASYNC);
+	}
+
+	if (flags & LIBTIME_INIT_TIMERSLACK)
+		set_timer_slack(1, flags & LIBTIME_INIT_ASYNC);
+
+	return 0;
+}
+
+int libtime_set_timer_slack(uint64_t slack_ns)
+{
+	return set_timer_slack(slack_ns, 0);
+}
+
+void libtime_sleep_info(struct libtime_sleep_info *info)
+{
+#if defined(TARGET_OS_LINUX)
+	info->timer_slack_ns = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+#else
+	info->timer_slack_ns = -1;
+#endif
+	info->max_sleep_ns = thread_sleep.calibrated ? thread_sleep.max_sleep_ns
+	                                             : READ_ONCE(max_sleep_ns);
+	info->overhead_ns = libtime_cpu_to_wall(READ_ONCE(sleep_overhead_clk));
+	info->margin_ns = libtime_sleep_margin();
+}
+
+void libtime_refine_sleep(void)
+{
+	calibrate_sleep(0);
+}
+
+void libtime_sleep_calibration(struct libtime_calibration *cal)
+{
+	cal->max_sleep_ns = READ_ONCE(max_sleep_ns);
+	cal->sleep_overhead_clk = READ_ONCE(sleep_overhead_clk);
+}
+
+void libtime_set_spin(SpinMode mode, uint64_t budget_ns)
+{
+	WRITE_ONCE(spin_mode, (uint8_t)mode);
+	WRITE_ONCE(spin_budget_ns, (int64_t)budget_ns);
+}
+
+void libtime_spin_stats(struct libtime_spin_stats *stats, int reset)
+{
+	stats->spins = spin_stats.spins;
+	stats->spin_ns = libtime_cpu_to_wall(spin_stats.spin_clk);
+	stats->max_spin_ns = libtime_cpu_to_wall(spin_stats.max_spin_clk);
+	stats->late_ns = libtime_cpu_to_wall(spin_stats.late_clk);
+	if (reset)
+		memset(&spin_stats, 0, sizeof(spin_stats));
+}
+
+static void sleep_model_update(uint64_t sample)
+{
+	struct sleep_model *m = &sleep_model;
+	int64_t err;
+
+	if (!m->samples++) {
+		m->mean8 = sample << 3;
+		m->dev4 = sample;
+		return;
+	}
+
+	err = (int64_t)(sample - (m->mean8 >> 3));
+	m->mean8 += err;
+	if (err < 0)
+		err = -err;
+	m->dev4 += err - (int64_t)(m->dev4 >> 2);
+}
+
+/*
+ * A sleep skipped only because of the deviation term teaches us nothing, so
+ * without this one bad sample could keep a thread spinning forever. Shrink
+ * the deviation a little each time, until the next sleep gets a new sample.
+ */
+static void sleep_model_skipped(uint64_t remaining)
+{
+	struct sleep_model *m = &sleep_model;
+
+	if (m->enabled && m->samples && remaining > (m->mean8 >> 3))
+		m->dev4 -= m->dev4 >> 3;
+}
+
+/*
+ * How close to the deadline we can hand off from the system sleep to
+ * spin_until(), in CPU clock cycles: the worst-case system sleep time at
+ * this thread's timer slack (or with the adaptive model, the mean plus four
+ * deviations of this thread's recent sleeps), or the spin budget if that's
+ * smaller.
+ */
+static uint64_t spin_margin(void)
+{
+	const struct sleep_model *m = &sleep_model;
+	int64_t max_sleep, budget;
+	uint64_t margin;
+
+	if (m->enabled && m->samples) {
+		margin = (m->mean8 >> 3) + m->dev4;
+	} else {
+		if (thread_sleep.calibrated)
+			max_sleep = thread_sleep.max_sleep_ns;
+		else
+			max_sleep = READ_ONCE(max_sleep_ns);
+		margin = libtime_wall_to_cpu(max_sleep > 0 ? max_sleep : 0);
+	}
+
+	budget = READ_ONCE(spin_budget_ns);
+	if (budget > 0 && libtime_wall_to_cpu(budget) < margin)
+		margin = libtime_wall_to_cpu(budget);
+	return margin;
+}
+
+void libtime_sleep_adaptive(int enable)
+{
+	memset(&sleep_model, 0, sizeof(sleep_model));
+	sleep_model.enabled = enable;
+}
+
+uint64_t libtime_sleep_margin(void)
+{
+	return libtime_cpu_to_wall(spin_margin());
+}
+
+uint64_t libtime_sleep_overhead(void)
+{
+	return READ_ONCE(sleep_overhead_clk);
+}
+
+uint64_t libtime_wait_until(uint64_t deadline)
+{
+	uint64_t now, wake, margin;
+
+	margin = spin_margin();
+	now = libtime_cpu();
+	if (now < deadline && deadline - now <= margin)
+		sleep_model_skipped(deadline - now);
+	/*
+	 * Sleep for half of the time left before 'margin' of the deadline, the
+	 * measured worst case for a short sleep. Long sleeps can wake later than
+	 * that, and the other half absorbs it. The sleeps get shorter as the
+	 * deadline nears, until they are the zero-length sleeps that were
+	 * calibrated, so this needs no more than a few wakeups even when the
+	 * timer slack is low.
+	 */
+	while (now < deadline && deadline - now > margin) {
+		wake = now + (deadline - now - margin) / 2;
+		_libtime_nanosleep(libtime_cpu_to_wall(wake - now));
+		now = libtime_cpu();
+		if (sleep_model.enabled) {
+			sleep_model_update(now > wake ? now - wake : 0);
+			margin = spin_margin();
+		}
+	}
+
+	return spin_until(now, deadline);
 }
 
 void libtime_nanosleep(int64_t ns)
 {
-	uint64_t s, e;
-	uint64_t ns_elapsed;
-	int64_t ns_to_sleep;
+	uint64_t s;
 
 	/*
 	 * Our goal is to sleep as close to 'ns' nanoseconds as possible. To
-	 * accomplish this, we use the system nanosleep functionality until another
-	 * sleep would take us over our quantum. Then we spin until we run the
+	 * accomplish this, we use the system nanosleep functionality until it gets
+	 * too close to the deadline to trust. Then we spin until we run the
 	 * clock down.
 	 */
-	s = libtime_cpu() - sleep_overhead_clk;
-	do {
-		e = libtime_cpu();
+	s = libtime_cpu() - READ_ONCE(sleep_overhead_clk);
+	if (ns <= 0)
+		return;
+	libtime_wait_until(s + libtime_wall_to_cpu(ns));
+}
 
-		ns_elapsed = libtime_cpu_to_wall(e - s);
-		ns_to_sleep = ns - ns_elapsed;
+void libtime_sleep_until(uint64_t deadline_ns, ClockType type)
+{
+	uint64_t now_ns, now, deadline;
+#if defined(USE_POSIX_CLOCKS) && !defined(TARGET_OS_FREEBSD)
+	struct timespec ts;
+	uint64_t sleep_ns, margin, wake;
+#endif
 
-		if (ns_to_sleep > max_sleep_ns) {
-			_libtime_nanosleep();
-		}
+	/*
+	 * Map the deadline onto the CPU clock for the spin phase, using one
+	 * reading of each clock.
+	 */
+	now_ns = _libtime_clocks[type]();
+	now = libtime_cpu();
+	if (deadline_ns <= now_ns)
+		return;
+	deadline = now + libtime_wall_to_cpu(deadline_ns - now_ns);
 
-	} while (ns_elapsed < ns);
+#if defined(USE_POSIX_CLOCKS) && !defined(TARGET_OS_FREEBSD)
+	/*
+	 * Then onto the sleep clock, so that the coarse phase is one absolute
+	 * sleep, which an interruption can simply restart.
+	 */
+	margin = spin_margin();
+	if (deadline - now > margin) {
+		wake = deadline - margin;
+		clock_gettime(clock_id, &ts);
+		sleep_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec + libtime_cpu_to_wall(wake - now);
+		ts.tv_sec = sleep_ns / 1000000000ULL;
+		ts.tv_nsec = sleep_ns % 1000000000ULL;
+		while (clock_nanosleep(clock_id, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		now = libtime_cpu();
+		if (sleep_model.enabled)
+			sleep_model_update(now > wake ? now - wake : 0);
+	} else {
+		sleep_model_skipped(deadline - now);
+	}
+	spin_until(now, deadline);
+#else
+	libtime_wait_until(deadline);
+#endif
 }
 
 /* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,143 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_ticker.h"
+#include "libtime_internal.h"
+
+#include <string.h>
+
+void libtime_ticker_init(struct libtime_ticker *t, uint64_t period_ns, TickerPolicy policy)
+{
+	memset(t, 0, sizeof(*t));
+	t->period = libtime_wall_to_cpu(period_ns);
+	if (!t->period)
+		t->period = 1;
+	t->policy = policy;
+	t->min_error = INT64_MAX;
+	t->max_error = INT64_MIN;
+	libtime_ticker_reset(t);
+}
+
+void libtime_ticker_reset(struct libtime_ticker *t)
+{
+	t->next = libtime_cpu() + t->period;
+}
+
+static unsigned int error_bucket(uint64_t ns)
+{
+	unsigned int b = 0;
+	while (ns >= 64 && b < LIBTIME_TICKER_BUCKETS - 1) {
+		ns >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static void record(struct libtime_ticker *t, uint64_t now, uint64_t tick)
+{
+	int64_t error = (int64_t)(now - tick);
+
+	t->ticks++;
+	t->sum_error += error;
+	if (error < t->min_error)
+		t->min_error = error;
+	if (error > t->max_error)
+		t->max_error = error;
+	if (error < 0) {
+		t->early++;
+		t->early_hist[error_bucket(libtime_cpu_to_wall(tick - now))]++;
+	} else if (error > 0) {
+		t->late++;
+		t->late_hist[error_bucket(libtime_cpu_to_wall(now - tick))]++;
+	}
+}
+
+uint64_t libtime_ticker_wait(struct libtime_ticker *t)
+{
+	uint64_t now, tick, behind;
+
+	now = libtime_cpu();
+	tick = t->next;
+
+	if (now < tick) {
+		/*
+		 * Aim to return the measured call overhead early, so that the
+		 * caller sees the tick on time.
+		 */
+		now = libtime_wait_until(tick - libtime_sleep_overhead());
+		t->next = tick + t->period;
+		record(t, now, tick);
+		return 0;
+	}
+
+	/* Late: count the ticks which are also due beyond this one */
+	behind = (now - tick) / t->period;
+
+	switch (t->policy) {
+	case TICKER_SKIP:
+		t->missed += behind + 1;
+		tick += (behind + 1) * t->period;
+		now = libtime_wait_until(tick - libtime_sleep_overhead());
+		t->next = tick + t->period;
+		record(t, now, tick);
+		return behind + 1;
+	case TICKER_RESET:
+		t->missed += behind;
+		t->next = now + t->period;
+		record(t, now, tick);
+		return behind;
+	default:
+		t->next = tick + t->period;
+		record(t, now, tick);
+		return behind;
+	}
+}
+
+static int64_t error_ns(int64_t error)
+{
+	if (error < 0)
+		return -(int64_t)libtime_cpu_to_wall((uint64_t)-error);
+	return (int64_t)libtime_cpu_to_wall((uint64_t)error);
+}
+
+void libtime_ticker_stats(const struct libtime_ticker *t, struct libtime_ticker_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->ticks = t->ticks;
+	stats->missed = t->missed;
+	stats->early = t->early;
+	stats->late = t->late;
+	if (!t->ticks)
+		return;
+
+	stats->min_error_ns = error_ns(t->min_error);
+	stats->max_error_ns = error_ns(t->max_error);
+	stats->mean_error_ns = error_ns(t->sum_error / (int64_t)t->ticks);
+	for (i = 0; i < LIBTIME_TICKER_BUCKETS; i++) {
+		stats->early_hist[i] = t->early_hist[i];
+		stats->late_hist[i] = t->late_hist[i];
+	}
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
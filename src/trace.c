@@ -0,0 +1,472 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_trace.h"
+#include "libtime_internal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(TARGET_OS_WINDOWS)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/* Output staged between calls to the write function */
+#define TRACE_BUF_SIZE 65536
+
+/* Events converted at a time */
+#define TRACE_BATCH 256
+
+/* Longer names are cut short in Perfetto output */
+#define MAX_NAME 512
+
+#define NR_ANCHOR_TRIES 8
+
+/* Perfetto protobuf field numbers */
+#define TRACE_PACKET                    1
+#define PACKET_CLOCK_SNAPSHOT           6
+#define PACKET_TIMESTAMP                8
+#define PACKET_SEQUENCE_ID              10
+#define PACKET_TRACK_EVENT              11
+#define PACKET_SEQUENCE_FLAGS           13
+#define PACKET_TIMESTAMP_CLOCK_ID       58
+#define PACKET_TRACK_DESCRIPTOR         60
+#define CLOCK_SNAPSHOT_CLOCKS           1
+#define CLOCK_SNAPSHOT_PRIMARY          2
+#define CLOCK_ID                        1
+#define CLOCK_TIMESTAMP                 2
+#define TRACK_EVENT_TYPE                9
+#define TRACK_EVENT_TRACK_UUID          11
+#define TRACK_EVENT_NAME                23
+#define TRACK_DESCRIPTOR_UUID           1
+#define TRACK_DESCRIPTOR_THREAD         4
+#define THREAD_DESCRIPTOR_PID           1
+#define THREAD_DESCRIPTOR_TID           2
+#define THREAD_DESCRIPTOR_NAME          5
+
+#define TYPE_SLICE_BEGIN                1
+#define TYPE_SLICE_END                  2
+#define SEQ_INCREMENTAL_STATE_CLEARED   1
+
+/* Perfetto's BuiltinClock values */
+#define BUILTIN_CLOCK_REALTIME          1
+#define BUILTIN_CLOCK_MONOTONIC         3
+#define BUILTIN_CLOCK_MONOTONIC_COARSE  4
+
+#define SEQUENCE_ID 1
+
+struct libtime_trace {
+	TraceFormat format;
+	libtime_trace_write_fn fn;
+	void *arg;
+	FILE *file;
+	int error;
+	uint64_t pid;
+	uint64_t clock_id;
+	uint64_t nr_events;
+
+	/* A CPU clock value and libtime_wall() taken together, and the
+	 * offset from the libtime_cpu_ns() timeline to libtime_wall().
+	 */
+	uint64_t anchor_cycles;
+	uint64_t anchor_wall;
+	int64_t cpu_ns_offset;
+
+	/* Threads with a Perfetto track so far */
+	uint64_t *tids;
+	size_t nr_tids;
+	size_t max_tids;
+
+	size_t len;
+	uint8_t buf[TRACE_BUF_SIZE];
+};
+
+static void flush(struct libtime_trace *t)
+{
+	if (t->len && !t->error && t->fn(t->arg, t->buf, t->len))
+		t->error = 1;
+	t->len = 0;
+}
+
+static void out(struct libtime_trace *t, const void *data, size_t len)
+{
+	if (t->len + len > TRACE_BUF_SIZE)
+		flush(t);
+	if (len > TRACE_BUF_SIZE) {
+		if (!t->error && t->fn(t->arg, data, len))
+			t->error = 1;
+		return;
+	}
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+}
+
+static void out_str(struct libtime_trace *t, const char *s)
+{
+	out(t, s, strlen(s));
+}
+
+/* JSON string contents, escaped */
+static void out_json_str(struct libtime_trace *t, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run = s;
+	char esc[6];
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		out(t, run, s - run);
+		run = s + 1;
+		if (c == '"' || c == '\\') {
+			esc[0] = '\\';
+			esc[1] = c;
+			out(t, esc, 2);
+		} else {
+			memcpy(esc, "\\u00", 4);
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			out(t, esc, 6);
+		}
+	}
+	out(t, run, s - run);
+}
+
+static uint8_t *pb_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static uint8_t *pb_uint(uint8_t *p, uint32_t field, uint64_t v)
+{
+	p = pb_varint(p, (uint64_t)field << 3);
+	return pb_varint(p, v);
+}
+
+static uint8_t *pb_bytes(uint8_t *p, uint32_t field, const void *data, size_t len)
+{
+	p = pb_varint(p, ((uint64_t)field << 3) | 2);
+	p = pb_varint(p, len);
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static uint8_t *pb_string(uint8_t *p, uint32_t field, const char *s)
+{
+	size_t len = strlen(s);
+	return pb_bytes(p, field, s, len < MAX_NAME ? len : MAX_NAME);
+}
+
+static void out_packet(struct libtime_trace *t, const uint8_t *packet, size_t len)
+{
+	uint8_t buf[MAX_NAME + 128], *p;
+
+	p = pb_bytes(buf, TRACE_PACKET, packet, len);
+	out(t, buf, p - buf);
+}
+
+static uint64_t track_uuid(const struct libtime_trace *t, uint64_t tid)
+{
+	return (t->pid << 32) ^ tid ^ 0x6c69627469696d65ULL;
+}
+
+static void perfetto_thread(struct libtime_trace *t, uint64_t tid, const char *name)
+{
+	uint8_t thread[MAX_NAME + 32], track[MAX_NAME + 64], packet[MAX_NAME + 96];
+	uint8_t *p, *q, *r;
+
+	p = pb_uint(thread, THREAD_DESCRIPTOR_PID, t->pid);
+	p = pb_uint(p, THREAD_DESCRIPTOR_TID, tid);
+	if (name)
+		p = pb_string(p, THREAD_DESCRIPTOR_NAME, name);
+
+	q = pb_uint(track, TRACK_DESCRIPTOR_UUID, track_uuid(t, tid));
+	q = pb_bytes(q, TRACK_DESCRIPTOR_THREAD, thread, p - thread);
+
+	r = pb_uint(packet, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+	r = pb_bytes(r, PACKET_TRACK_DESCRIPTOR, track, q - track);
+	out_packet(t, packet, r - packet);
+}
+
+/* Give each thread a track the first time it's seen. */
+static void perfetto_track(struct libtime_trace *t, uint64_t tid)
+{
+	uint64_t *tids;
+	size_t i;
+
+	for (i = t->nr_tids; i > 0; i--)
+		if (t->tids[i - 1] == tid)
+			return;
+
+	if (t->nr_tids == t->max_tids) {
+		tids = realloc(t->tids, (t->max_tids ? t->max_tids * 2 : 16) * sizeof(uint64_t));
+		if (!tids) {
+			t->error = 1;
+			return;
+		}
+		t->tids = tids;
+		t->max_tids = t->max_tids ? t->max_tids * 2 : 16;
+	}
+	t->tids[t->nr_tids++] = tid;
+	perfetto_thread(t, tid, NULL);
+}
+
+static void perfetto_slice(struct libtime_trace *t, int type, const char *name,
+                           uint64_t tid, uint64_t ts)
+{
+	uint8_t event[MAX_NAME + 32], packet[MAX_NAME + 64];
+	uint8_t *p, *q;
+
+	p = pb_uint(event, TRACK_EVENT_TYPE, type);
+	p = pb_uint(p, TRACK_EVENT_TRACK_UUID, track_uuid(t, tid));
+	if (name)
+		p = pb_string(p, TRACK_EVENT_NAME, name);
+
+	q = pb_uint(packet, PACKET_TIMESTAMP, ts);
+	q = pb_uint(q, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+	q = pb_uint(q, PACKET_TIMESTAMP_CLOCK_ID, t->clock_id);
+	q = pb_bytes(q, PACKET_TRACK_EVENT, event, p - event);
+	out_packet(t, packet, q - packet);
+}
+
+/* Write one span, with 'ts' on the libtime_wall() timeline. */
+static void emit(struct libtime_trace *t, const char *name, uint64_t tid,
+                 uint64_t ts, uint64_t dur)
+{
+	char num[128];
+
+	if (t->format == TRACE_PERFETTO) {
+		/* The trace processor sorts slices into order. */
+		perfetto_track(t, tid);
+		perfetto_slice(t, TYPE_SLICE_BEGIN, name, tid, ts);
+		perfetto_slice(t, TYPE_SLICE_END, NULL, tid, ts + dur);
+	} else {
+		out_str(t, t->nr_events ? ",\n{\"name\":\"" : "{\"name\":\"");
+		out_json_str(t, name);
+		snprintf(num, sizeof(num),
+		         "\",\"ph\":\"X\",\"pid\":%" PRIu64 ",\"tid\":%" PRIu64
+		         ",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u}",
+		         t->pid, tid, ts / 1000, (unsigned int)(ts % 1000),
+		         dur / 1000, (unsigned int)(dur % 1000));
+		out_str(t, num);
+	}
+	t->nr_events++;
+}
+
+static uint64_t current_pid(void)
+{
+#if defined(TARGET_OS_WINDOWS)
+	return GetCurrentProcessId();
+#else
+	return (uint64_t)getpid();
+#endif
+}
+
+/*
+ * Take a (CPU clock, wall clock) pair, keeping the tightest bracket of a few
+ * tries, as the drift corrector does.
+ */
+static void take_anchor(struct libtime_trace *t)
+{
+	struct libtime_cpu_conv conv;
+	uint64_t s, e, w, best = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < NR_ANCHOR_TRIES; i++) {
+		s = libtime_cpu_start();
+		w = libtime_wall();
+		e = libtime_cpu_stop(NULL);
+		if (e - s < best) {
+			best = e - s;
+			t->anchor_cycles = s + (e - s) / 2;
+			t->anchor_wall = w;
+		}
+	}
+	_libtime_cpu_conv_read(&conv);
+	t->cpu_ns_offset = (int64_t)(t->anchor_wall - _libtime_cpu_ns_at(&conv, t->anchor_cycles));
+}
+
+/*
+ * The Perfetto clock that libtime_wall() reads. Clocks Perfetto has no
+ * name for, such as mach_absolute_time, are monotonic like
+ * CLOCK_MONOTONIC and are given as that.
+ */
+static uint64_t wall_builtin_clock(void)
+{
+	const struct libtime_clock_info *info = libtime_clock_info(CLOCK_WALL);
+
+	if (info && info->name) {
+		if (!strcmp(info->name, "CLOCK_REALTIME"))
+			return BUILTIN_CLOCK_REALTIME;
+		if (!strcmp(info->name, "CLOCK_MONOTONIC_COARSE"))
+			return BUILTIN_CLOCK_MONOTONIC_COARSE;
+	}
+	return BUILTIN_CLOCK_MONOTONIC;
+}
+
+struct libtime_trace *libtime_trace_open(TraceFormat format, libtime_trace_write_fn fn, void *arg)
+{
+	struct libtime_trace *t;
+	uint8_t clock[32], snapshot[48], packet[64], *p, *q, *r;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->format = format;
+	t->fn = fn;
+	t->arg = arg;
+	t->pid = current_pid();
+	take_anchor(t);
+
+	if (format == TRACE_PERFETTO) {
+		/* Make libtime_wall()'s clock the trace's clock, so timestamps
+		 * are taken as they are.
+		 */
+		t->clock_id = wall_builtin_clock();
+		p = pb_uint(clock, CLOCK_ID, t->clock_id);
+		p = pb_uint(p, CLOCK_TIMESTAMP, t->anchor_wall);
+		q = pb_bytes(snapshot, CLOCK_SNAPSHOT_CLOCKS, clock, p - clock);
+		q = pb_uint(q, CLOCK_SNAPSHOT_PRIMARY, t->clock_id);
+		r = pb_uint(packet, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+		r = pb_uint(r, PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+		r = pb_bytes(r, PACKET_CLOCK_SNAPSHOT, snapshot, q - snapshot);
+		out_packet(t, packet, r - packet);
+	} else {
+		out_str(t, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	}
+	return t;
+}
+
+static int write_file(void *arg, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, arg) != len;
+}
+
+struct libtime_trace *libtime_trace_open_file(TraceFormat format, const char *path)
+{
+	struct libtime_trace *t;
+	FILE *file;
+
+	file = fopen(path, "wb");
+	if (!file)
+		return NULL;
+	t = libtime_trace_open(format, write_file, file);
+	if (!t) {
+		fclose(file);
+		return NULL;
+	}
+	t->file = file;
+	return t;
+}
+
+int libtime_trace_write(struct libtime_trace *t, const struct libtime_trace_event *events, size_t n)
+{
+	uint64_t starts[TRACE_BATCH], durs[TRACE_BATCH];
+	uint64_t base, base_wall;
+	size_t i, count;
+
+	while (n && !t->error) {
+		count = n < TRACE_BATCH ? n : TRACE_BATCH;
+
+		/* Convert offsets from the earliest start in the batch, so that
+		 * only one value needs the anchor's sign handled.
+		 */
+		base = events[0].start;
+		for (i = 1; i < count; i++)
+			if (events[i].start < base)
+				base = events[i].start;
+		for (i = 0; i < count; i++) {
+			starts[i] = events[i].start - base;
+			durs[i] = events[i].end > events[i].start ? events[i].end - events[i].start : 0;
+		}
+		libtime_cpu_to_wall_batch(starts, starts, count);
+		libtime_cpu_to_wall_batch(durs, durs, count);
+
+		if (base >= t->anchor_cycles)
+			base_wall = t->anchor_wall + libtime_cpu_to_wall(base - t->anchor_cycles);
+		else
+			base_wall = t->anchor_wall - libtime_cpu_to_wall(t->anchor_cycles - base);
+
+		for (i = 0; i < count; i++)
+			emit(t, events[i].name, events[i].tid, base_wall + starts[i], durs[i]);
+
+		events += count;
+		n -= count;
+	}
+	return t->error;
+}
+
+void libtime_trace_zones(void *arg, const struct libtime_zone_record *records, size_t n)
+{
+	struct libtime_trace *t = arg;
+	size_t i;
+
+	for (i = 0; i < n && !t->error; i++)
+		emit(t, records[i].site->name, records[i].thread_id,
+		     records[i].start_ns + t->cpu_ns_offset, records[i].duration_ns);
+}
+
+int libtime_trace_thread_name(struct libtime_trace *t, uint64_t tid, const char *name)
+{
+	char num[96];
+
+	if (t->format == TRACE_PERFETTO) {
+		perfetto_thread(t, tid, name);
+		return t->error;
+	}
+
+	out_str(t, t->nr_events ? ",\n" : "");
+	snprintf(num, sizeof(num),
+	         "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%" PRIu64 ",\"tid\":%" PRIu64
+	         ",\"args\":{\"name\":\"", t->pid, tid);
+	out_str(t, num);
+	out_json_str(t, name);
+	out_str(t, "\"}}");
+	t->nr_events++;
+	return t->error;
+}
+
+int libtime_trace_close(struct libtime_trace *t)
+{
+	int error;
+
+	if (t->format == TRACE_JSON)
+		out_str(t, "\n]}\n");
+	flush(t);
+	error = t->error;
+	if (t->file && fclose(t->file))
+		error = 1;
+	free(t->tids);
+	free(t);
+	return error;
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -44,6 +44,19 @@ uint64_t libtime_wall_fast(void)
 	return libtime_wall();
 }
 
+static uint64_t read_wall(const void *arg)
+{
+	return libtime_wall();
+}
+
+void libtime_wallclock_info(struct libtime_clock_info *wall, struct libtime_clock_info *wall_fast)
+{
+	wall->name = "mach_absolute_time";
+	wall->resolution_ns = (timebase.numer + timebase.denom - 1) / timebase.denom;
+	libtime_clock_measure(read_wall, NULL, wall);
+	*wall_fast = *wall;
+}
+
 #endif
 
 /* vim: set ts=4 sw=4 noai noet: */
@@ -27,60 +27,112 @@
 #include <errno.h>
 #include <time.h>
 
-static const clockid_t precise_clocks[] = {
-//#ifdef CLOCK_MONOTONIC_RAW
-//	CLOCK_MONOTONIC_RAW,
-//#endif
+struct wall_clock {
+	clockid_t id;
+	const char *name;
+};
+
+/* In order of preference, when they cost the same to read. These all
+ * follow NTP's frequency corrections; CLOCK_MONOTONIC_RAW doesn't, so
+ * libtime_wall() would run at a different rate depending on which clock
+ * happened to measure cheapest.
+ */
+static const struct wall_clock candidates[] = {
 #ifdef CLOCK_MONOTONIC
-	CLOCK_MONOTONIC,
+	{ CLOCK_MONOTONIC, "CLOCK_MONOTONIC" },
 #endif
-	CLOCK_REALTIME
-};
-static const clockid_t fast_clocks[] = {
 #ifdef CLOCK_MONOTONIC_COARSE
-	CLOCK_MONOTONIC_COARSE,
+	{ CLOCK_MONOTONIC_COARSE, "CLOCK_MONOTONIC_COARSE" },
 #endif
-//#ifdef CLOCK_MONOTONIC_RAW
-//	CLOCK_MONOTONIC_RAW,
-//#endif
-#ifdef CLOCK_MONOTONIC
-	CLOCK_MONOTONIC,
-#endif
-	CLOCK_REALTIME
 };
 
-static clockid_t precise_clock;
-static clockid_t fast_clock;
+/* Used only if none of the candidates work. */
+static const struct wall_clock fallback = { CLOCK_REALTIME, "CLOCK_REALTIME" };
 
-static int select_clocksource(clockid_t *target, const clockid_t *sources, size_t n)
+static clockid_t precise_clock = CLOCK_REALTIME;
+static clockid_t fast_clock = CLOCK_REALTIME;
+static struct libtime_clock_info precise_info, fast_info;
+
+static int probe_clocksource(clockid_t id, uint64_t *resolution)
 {
 	struct timespec ts;
-	for (int i = 0; i < n; i++) {
-		*target = sources[i];
 retry:
-		if (clock_gettime(*target, &ts) == 0) {
-			/* Success! */
-			return 0;
-		} else {
-			switch (errno) {
-			case EINTR:
-				/* Interrupted prematurely, retry the call. */
-				goto retry;
-			case EINVAL:
-				/* Try the next clock in line... */
-				break;
-			}
-		}
+	if (clock_gettime(id, &ts) != 0) {
+		/* Interrupted prematurely, retry the call. */
+		if (errno == EINTR)
+			goto retry;
+		return 1;
 	}
-	return 1;
+	if (clock_getres(id, &ts) != 0)
+		ts.tv_sec = ts.tv_nsec = 0;
+	*resolution = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if (!*resolution)
+		*resolution = 1;
+	return 0;
 }
 
+static uint64_t read_clocksource(const void *arg)
+{
+	struct timespec ts;
+	clock_gettime(*(const clockid_t *)arg, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int measure_clocksource(const struct wall_clock *c, struct libtime_clock_info *info)
+{
+	if (probe_clocksource(c->id, &info->resolution_ns))
+		return 1;
+	info->name = c->name;
+	libtime_clock_measure(read_clocksource, &c->id, info);
+	return 0;
+}
+
+/*
+ * Time each candidate, and take the cheapest one which never went backwards
+ * for libtime_wall_fast(), and the cheapest with a fine resolution for
+ * libtime_wall().
+ */
 int libtime_init_wallclock(void)
 {
-	int r = 0;
-	r += select_clocksource(&precise_clock, precise_clocks, ELEM_SIZE(precise_clocks));
-	r += select_clocksource(&fast_clock, fast_clocks, ELEM_SIZE(fast_clocks));
-	return r;
+	struct libtime_clock_info info;
+	int have_precise = 0, have_fast = 0;
+	size_t i;
+
+	for (i = 0; i < ELEM_SIZE(candidates); i++) {
+		if (measure_clocksource(&candidates[i], &info) || info.backwards)
+			continue;
+		if (info.resolution_ns <= FINE_RESOLUTION_NS &&
+		    (!have_precise || libtime_clock_cheaper(&info, &precise_info))) {
+			precise_clock = candidates[i].id;
+			precise_info = info;
+			have_precise = 1;
+		}
+		if (!have_fast || libtime_clock_cheaper(&info, &fast_info)) {
+			fast_clock = candidates[i].id;
+			fast_info = info;
+			have_fast = 1;
+		}
+	}
+
+	if (!have_precise || !have_fast) {
+		if (measure_clocksource(&fallback, &info))
+			return 1;
+		if (!have_precise) {
+			precise_clock = fallback.id;
+			precise_info = info;
+		}
+		if (!have_fast) {
+			fast_clock = fallback.id;
+			fast_info = info;
+		}
+	}
+	return 0;
+}
+
+void libtime_wallclock_info(struct libtime_clock_info *wall, struct libtime_clock_info *wall_fast)
+{
+	*wall = precise_info;
+	*wall_fast = fast_info;
 }
 
 uint64_t libtime_wall(void)
@@ -47,6 +47,19 @@ uint64_t libtime_wall_fast()
 	return libtime_wall();
 }
 
+static uint64_t read_wall(const void *arg)
+{
+	return libtime_wall();
+}
+
+void libtime_wallclock_info(struct libtime_clock_info *wall, struct libtime_clock_info *wall_fast)
+{
+	wall->name = "QueryPerformanceCounter";
+	wall->resolution_ns = (1000000000ULL + perf_frequency.QuadPart - 1) / perf_frequency.QuadPart;
+	libtime_clock_measure(read_wall, NULL, wall);
+	*wall_fast = *wall;
+}
+
 #endif
 
 /* vim: set ts=4 sw=4 noai noet: */
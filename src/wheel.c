@@ -0,0 +1,326 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_wheel.h"
+#include "libtime_internal.h"
+
+#include <stdlib.h>
+
+/*
+ * Each level has 64 slots, each covering 64 times the span of a slot on the
+ * level below. Timers are kept in wheel units of (1 << shift) CPU clock
+ * cycles, so six levels reach 2^36 units ahead; anything further out is
+ * parked in the last slot and moved down again when it's reached.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6
+#define WHEEL_RANGE  (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define DEFAULT_RESOLUTION_NS 1000000ULL
+
+#define SLAB_TIMERS 256
+
+struct libtime_timer {
+	struct libtime_timer *next;
+	struct libtime_timer **pprev;
+	uint64_t expires;           /* In wheel units */
+	libtime_timer_fn fn;
+	void *arg;
+	unsigned int slot;          /* level * WHEEL_SLOTS + index */
+};
+
+struct timer_slab {
+	struct timer_slab *next;
+	struct libtime_timer timers[SLAB_TIMERS];
+};
+
+struct libtime_wheel {
+	uint64_t now;               /* Next wheel unit to process */
+	unsigned int shift;
+	uint64_t occupied[WHEEL_LEVELS];
+	struct libtime_timer *slots[WHEEL_LEVELS * WHEEL_SLOTS];
+	struct libtime_timer *expiring;
+	struct libtime_timer *free_timers;
+	struct timer_slab *slabs;
+};
+
+static inline unsigned int ctz64(uint64_t v)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+#  if defined(_WIN64)
+	_BitScanForward64(&index, v);
+#  else
+	if ((uint32_t)v) {
+		_BitScanForward(&index, (uint32_t)v);
+	} else {
+		_BitScanForward(&index, (uint32_t)(v >> 32));
+		index += 32;
+	}
+#  endif
+	return index;
+#else
+	return __builtin_ctzll(v);
+#endif
+}
+
+static void link_timer(struct libtime_wheel *w, struct libtime_timer *t)
+{
+	uint64_t delta, expires = t->expires;
+	unsigned int level, index;
+
+	if (expires < w->now)
+		expires = w->now;
+	delta = expires - w->now;
+	if (delta >= WHEEL_RANGE) {
+		delta = WHEEL_RANGE - 1;
+		expires = w->now + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+			break;
+	index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	t->slot = level * WHEEL_SLOTS + index;
+	t->next = w->slots[t->slot];
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = &w->slots[t->slot];
+	w->slots[t->slot] = t;
+	w->occupied[level] |= 1ULL << index;
+}
+
+static void unlink_timer(struct libtime_wheel *w, struct libtime_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	if (!w->slots[t->slot])
+		w->occupied[t->slot / WHEEL_SLOTS] &= ~(1ULL << (t->slot % WHEEL_SLOTS));
+}
+
+/* Take the whole list out of a slot. */
+static struct libtime_timer *detach_slot(struct libtime_wheel *w, unsigned int level, unsigned int index)
+{
+	unsigned int slot = level * WHEEL_SLOTS + index;
+	struct libtime_timer *list = w->slots[slot];
+
+	w->slots[slot] = NULL;
+	w->occupied[level] &= ~(1ULL << index);
+	return list;
+}
+
+static int add_slab(struct libtime_wheel *w)
+{
+	struct timer_slab *slab;
+	int i;
+
+	slab = malloc(sizeof(*slab));
+	if (!slab)
+		return 1;
+	slab->next = w->slabs;
+	w->slabs = slab;
+	for (i = 0; i < SLAB_TIMERS; i++) {
+		slab->timers[i].next = w->free_timers;
+		w->free_timers = &slab->timers[i];
+	}
+	return 0;
+}
+
+static void free_timer(struct libtime_wheel *w, struct libtime_timer *t)
+{
+	t->next = w->free_timers;
+	w->free_timers = t;
+}
+
+struct libtime_wheel *libtime_wheel_create(uint64_t resolution_ns)
+{
+	struct libtime_wheel *w;
+	uint64_t unit;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	/* Round the unit down to a power of two cycles */
+	unit = libtime_wall_to_cpu(resolution_ns ? resolution_ns : DEFAULT_RESOLUTION_NS);
+	while (unit > 1) {
+		unit >>= 1;
+		w->shift++;
+	}
+
+	w->now = libtime_cpu() >> w->shift;
+	return w;
+}
+
+void libtime_wheel_destroy(struct libtime_wheel *w)
+{
+	struct timer_slab *slab, *next;
+
+	if (!w)
+		return;
+	for (slab = w->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	free(w);
+}
+
+struct libtime_timer *libtime_wheel_add_at(struct libtime_wheel *w, uint64_t deadline, libtime_timer_fn fn, void *arg)
+{
+	struct libtime_timer *t;
+
+	if (!w->free_timers && add_slab(w))
+		return NULL;
+	t = w->free_timers;
+	w->free_timers = t->next;
+
+	/* Round up, so timers never fire early */
+	t->expires = (deadline >> w->shift) + ((deadline & ((1ULL << w->shift) - 1)) != 0);
+	t->fn = fn;
+	t->arg = arg;
+	link_timer(w, t);
+	return t;
+}
+
+struct libtime_timer *libtime_wheel_add(struct libtime_wheel *w, uint64_t timeout_ns, libtime_timer_fn fn, void *arg)
+{
+	return libtime_wheel_add_at(w, libtime_cpu() + libtime_wall_to_cpu(timeout_ns), fn, arg);
+}
+
+void libtime_wheel_cancel(struct libtime_wheel *w, struct libtime_timer *timer)
+{
+	unlink_timer(w, timer);
+	free_timer(w, timer);
+}
+
+/*
+ * The next wheel unit which has work to do: either a level 0 slot with
+ * timers in it, or the start of a higher level slot whose timers need moving
+ * down.
+ */
+static uint64_t next_unit(const struct libtime_wheel *w)
+{
+	uint64_t best = UINT64_MAX, occupied, base, start;
+	unsigned int level, shift, cur, d;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		occupied = w->occupied[level];
+		if (!occupied)
+			continue;
+
+		shift = level * WHEEL_BITS;
+		base = w->now >> shift;
+		cur = base & WHEEL_MASK;
+
+		/* Bit k of 'occupied' is now slot cur + k */
+		if (cur)
+			occupied = (occupied >> cur) | (occupied << (WHEEL_SLOTS - cur));
+
+		/*
+		 * Off a slot boundary, the current slot of a higher level
+		 * holds timers for its next time around.
+		 */
+		if (level && (w->now & ((1ULL << shift) - 1)))
+			occupied &= ~1ULL;
+		d = occupied ? ctz64(occupied) : WHEEL_SLOTS;
+
+		start = (base + d) << shift;
+		if (start < best)
+			best = start;
+	}
+	return best;
+}
+
+size_t libtime_wheel_expire(struct libtime_wheel *w, uint64_t now)
+{
+	struct libtime_timer *t, *next;
+	uint64_t target = now >> w->shift, unit;
+	unsigned int level;
+	libtime_timer_fn fn;
+	void *arg;
+	size_t count = 0;
+
+	while ((unit = next_unit(w)) <= target) {
+		w->now = unit;
+
+		/* Move timers down from any higher level slots starting here */
+		for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+			if (unit & ((1ULL << (WHEEL_BITS * level)) - 1))
+				continue;
+			t = detach_slot(w, level, (unit >> (WHEEL_BITS * level)) & WHEEL_MASK);
+			for (; t; t = next) {
+				next = t->next;
+				link_timer(w, t);
+			}
+		}
+
+		/*
+		 * Move past this unit before running anything, so that timers
+		 * added by the callbacks land in a slot that's still to come.
+		 */
+		w->expiring = detach_slot(w, 0, unit & WHEEL_MASK);
+		if (w->expiring)
+			w->expiring->pprev = &w->expiring;
+		w->now = unit + 1;
+
+		while ((t = w->expiring)) {
+			fn = t->fn;
+			arg = t->arg;
+			w->expiring = t->next;
+			if (t->next)
+				t->next->pprev = &w->expiring;
+			free_timer(w, t);
+			fn(arg);
+			count++;
+		}
+	}
+
+	if (w->now <= target)
+		w->now = target + 1;
+	return count;
+}
+
+uint64_t libtime_wheel_next(const struct libtime_wheel *w)
+{
+	uint64_t unit = next_unit(w);
+
+	if (unit == UINT64_MAX || unit >= (UINT64_MAX >> w->shift))
+		return UINT64_MAX;
+	return unit << w->shift;
+}
+
+int64_t libtime_wheel_next_ns(const struct libtime_wheel *w, uint64_t now)
+{
+	uint64_t next = libtime_wheel_next(w);
+
+	if (next == UINT64_MAX)
+		return -1;
+	if (next <= now)
+		return 0;
+	return (int64_t)libtime_cpu_to_wall(next - now);
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,320 @@
+/*
+ * libtime
+ *
+ * High resolution timing library.
+ *
+ * Copyright (c) 2014-2017, Steven Noonan <steven@uplinklabs.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "libtime.h"
+#include "libtime_zone.h"
+#include "libtime_internal.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(TARGET_OS_WINDOWS)
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <pthread.h>
+#if defined(TARGET_OS_LINUX)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+#define CACHE_LINE 64
+
+/* Zones each thread can buffer between collections */
+#define RING_BITS 12
+#define RING_SIZE (1U << RING_BITS)
+#define RING_MASK (RING_SIZE - 1)
+
+/* Zones passed to the collector's callback at a time */
+#define COLLECT_BATCH 256
+
+struct zone_event {
+	const struct libtime_zone_site *site;
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * A single-producer, single-consumer ring. The owning thread writes only the
+ * fields on the first cache line, and the collector only 'tail', so neither
+ * side's writes take the other's line away. The owner keeps a copy of
+ * 'tail' and only reads the real one when the ring looks full.
+ */
+struct zone_ring {
+	uint64_t head;
+	uint64_t tail_cache;
+	uint64_t dropped;
+	uint8_t pad0[CACHE_LINE - 3 * sizeof(uint64_t)];
+
+	uint64_t tail;
+	uint8_t pad1[CACHE_LINE - sizeof(uint64_t)];
+
+	uint64_t thread_id;
+	int exited;
+	struct zone_ring *next;
+
+	struct zone_event events[RING_SIZE];
+};
+
+static LIBTIME_THREAD_LOCAL struct zone_ring *thread_ring;
+
+/*
+ * Every thread's ring, newest first. New rings are pushed under list_lock.
+ * Only the collector, holding collect_lock, unlinks and frees them, so it
+ * can walk the list without list_lock.
+ */
+static struct zone_ring *rings;
+static uint64_t retired_dropped;
+
+static void ring_exit(struct zone_ring *r)
+{
+	thread_ring = NULL;
+	STORE_RELEASE(r->exited, 1);
+}
+
+#if defined(TARGET_OS_WINDOWS)
+
+static SRWLOCK list_lock = SRWLOCK_INIT;
+static SRWLOCK collect_lock = SRWLOCK_INIT;
+static INIT_ONCE exit_once = INIT_ONCE_STATIC_INIT;
+static DWORD exit_slot = FLS_OUT_OF_INDEXES;
+
+#define lock(l)   AcquireSRWLockExclusive(l)
+#define unlock(l) ReleaseSRWLockExclusive(l)
+
+static VOID WINAPI fls_exit(PVOID arg)
+{
+	if (arg)
+		ring_exit(arg);
+}
+
+static BOOL CALLBACK exit_init(PINIT_ONCE once, PVOID param, PVOID *ctx)
+{
+	exit_slot = FlsAlloc(fls_exit);
+	return TRUE;
+}
+
+/* Have ring_exit() called when the calling thread exits. */
+static void ring_watch_exit(struct zone_ring *r)
+{
+	InitOnceExecuteOnce(&exit_once, exit_init, NULL, NULL);
+	if (exit_slot != FLS_OUT_OF_INDEXES)
+		FlsSetValue(exit_slot, r);
+}
+
+static uint64_t current_thread_id(void)
+{
+	return GetCurrentThreadId();
+}
+
+static struct zone_ring *ring_alloc(void)
+{
+	return _aligned_malloc(sizeof(struct zone_ring), CACHE_LINE);
+}
+
+static void ring_free(struct zone_ring *r)
+{
+	_aligned_free(r);
+}
+
+#else
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t collect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static int exit_key_ok;
+
+#define lock(l)   pthread_mutex_lock(l)
+#define unlock(l) pthread_mutex_unlock(l)
+
+static void key_exit(void *arg)
+{
+	ring_exit(arg);
+}
+
+static void exit_init(void)
+{
+	exit_key_ok = !pthread_key_create(&exit_key, key_exit);
+}
+
+/* Have ring_exit() called when the calling thread exits. */
+static void ring_watch_exit(struct zone_ring *r)
+{
+	pthread_once(&exit_once, exit_init);
+	if (exit_key_ok)
+		pthread_setspecific(exit_key, r);
+}
+
+static uint64_t current_thread_id(void)
+{
+#if defined(TARGET_OS_LINUX)
+	return (uint64_t)syscall(SYS_gettid);
+#elif defined(TARGET_OS_MACOSX)
+	uint64_t tid;
+	pthread_threadid_np(NULL, &tid);
+	return tid;
+#else
+	return (uint64_t)(uintptr_t)pthread_self();
+#endif
+}
+
+static struct zone_ring *ring_alloc(void)
+{
+	void *p;
+	if (posix_memalign(&p, CACHE_LINE, sizeof(struct zone_ring)))
+		return NULL;
+	return p;
+}
+
+static void ring_free(struct zone_ring *r)
+{
+	free(r);
+}
+
+#endif
+
+static struct zone_ring *ring_create(void)
+{
+	struct zone_ring *r;
+
+	r = ring_alloc();
+	if (!r)
+		return NULL;
+	memset(r, 0, offsetof(struct zone_ring, events));
+	r->thread_id = current_thread_id();
+
+	lock(&list_lock);
+	r->next = rings;
+	STORE_RELEASE(rings, r);
+	unlock(&list_lock);
+
+	ring_watch_exit(r);
+	thread_ring = r;
+	return r;
+}
+
+static void ring_unlink(struct zone_ring *r)
+{
+	struct zone_ring **pr;
+
+	lock(&list_lock);
+	for (pr = &rings; *pr != r; pr = &(*pr)->next)
+		;
+	*pr = r->next;
+	unlock(&list_lock);
+}
+
+void libtime_zone_end(struct libtime_zone *z)
+{
+	uint64_t end = libtime_cpu();
+	struct zone_ring *r = thread_ring;
+	struct zone_event *e;
+	uint64_t head;
+
+	if (!r && !(r = ring_create()))
+		return;
+
+	head = r->head;
+	if (head - r->tail_cache >= RING_SIZE) {
+		r->tail_cache = LOAD_ACQUIRE(r->tail);
+		if (head - r->tail_cache >= RING_SIZE) {
+			WRITE_ONCE(r->dropped, r->dropped + 1);
+			return;
+		}
+	}
+
+	e = &r->events[head & RING_MASK];
+	e->site = z->site;
+	e->start = z->start;
+	e->end = end;
+	STORE_RELEASE(r->head, head + 1);
+}
+
+static size_t ring_drain(struct zone_ring *r, const struct libtime_cpu_conv *conv,
+                         libtime_zone_fn fn, void *arg)
+{
+	struct libtime_zone_record out[COLLECT_BATCH];
+	const struct zone_event *e;
+	uint64_t head, tail;
+	size_t n, total = 0;
+
+	head = LOAD_ACQUIRE(r->head);
+	tail = r->tail;
+	while (tail != head) {
+		for (n = 0; n < COLLECT_BATCH && tail != head; n++, tail++) {
+			e = &r->events[tail & RING_MASK];
+			out[n].site = e->site;
+			out[n].thread_id = r->thread_id;
+			out[n].start_ns = _libtime_cpu_ns_at(conv, e->start);
+			out[n].duration_ns = _libtime_cpu_scale(conv, e->end - e->start);
+		}
+
+		/* They're copied out, so the owner can have the slots back. */
+		STORE_RELEASE(r->tail, tail);
+		fn(arg, out, n);
+		total += n;
+	}
+	return total;
+}
+
+size_t libtime_zone_collect(libtime_zone_fn fn, void *arg)
+{
+	struct libtime_cpu_conv conv;
+	struct zone_ring *r, *next;
+	size_t total = 0;
+	int exited;
+
+	lock(&collect_lock);
+	_libtime_cpu_conv_read(&conv);
+	for (r = LOAD_ACQUIRE(rings); r; r = next) {
+		next = r->next;
+
+		/* Whatever an exited thread recorded is visible once we see it exit. */
+		exited = LOAD_ACQUIRE(r->exited);
+		total += ring_drain(r, &conv, fn, arg);
+		if (exited) {
+			retired_dropped += r->dropped;
+			ring_unlink(r);
+			ring_free(r);
+		}
+	}
+	unlock(&collect_lock);
+
+	return total;
+}
+
+uint64_t libtime_zone_dropped(void)
+{
+	struct zone_ring *r;
+	uint64_t dropped;
+
+	lock(&collect_lock);
+	dropped = retired_dropped;
+	for (r = LOAD_ACQUIRE(rings); r; r = r->next)
+		dropped += READ_ONCE(r->dropped);
+	unlock(&collect_lock);
+
+	return dropped;
+}
+
+/* vim: set ts=4 sw=4 noai noet: */
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <libtime.h>
+#include <inttypes.h>
+
+#define NR_ELEMS (1 << 20)
+#define NR_RUNS 10
+
+int main(int argc, char **argv)
+{
+	uint64_t *ticks, *scalar, *batch;
+	uint64_t s, e, best_scalar = UINT64_MAX, best_batch = UINT64_MAX;
+	size_t i, mismatches = 0;
+	int j;
+
+	libtime_init();
+
+	ticks = malloc(NR_ELEMS * sizeof(uint64_t));
+	scalar = malloc(NR_ELEMS * sizeof(uint64_t));
+	batch = malloc(NR_ELEMS * sizeof(uint64_t));
+	if (!ticks || !scalar || !batch)
+		return 1;
+
+	/* Something resembling a trace buffer: increasing raw timestamps */
+	ticks[0] = libtime_cpu();
+	for (i = 1; i < NR_ELEMS; i++)
+		ticks[i] = ticks[i - 1] + (rand() & 0xfff);
+
+	for (j = 0; j < NR_RUNS; j++) {
+		s = libtime_cpu();
+		for (i = 0; i < NR_ELEMS; i++)
+			scalar[i] = libtime_cpu_to_wall(ticks[i]);
+		e = libtime_cpu();
+		if (e - s < best_scalar)
+			best_scalar = e - s;
+
+		s = libtime_cpu();
+		libtime_cpu_to_wall_batch(ticks, batch, NR_ELEMS);
+		e = libtime_cpu();
+		if (e - s < best_batch)
+			best_batch = e - s;
+	}
+
+	for (i = 0; i < NR_ELEMS; i++)
+		if (scalar[i] != batch[i])
+			mismatches++;
+
+	printf("scalar: %.1f Melem/s\n", NR_ELEMS * 1000.0 / libtime_cpu_to_wall(best_scalar));
+	printf("batch:  %.1f Melem/s\n", NR_ELEMS * 1000.0 / libtime_cpu_to_wall(best_batch));
+	printf("mismatches: %zu\n", mismatches);
+
+	free(ticks);
+	free(scalar);
+	free(batch);
+
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <chrono>
+#include <libtime.h>
+#include <inttypes.h>
+
+/* Reads per timed batch when measuring latency, and batches per thread */
+#define BATCH 16
+#define NR_BATCHES 2000
+
+/* Wall time each thread spends reading as fast as it can */
+#define THROUGHPUT_NS 100000000ULL
+
+/* Reads between checks of the deadline */
+#define THROUGHPUT_CHUNK 256
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	int nr_batches;
+	uint64_t budget;
+	pthread_barrier_t *barrier;
+	uint64_t *batches;      /* CPU clock cycles for each batch of reads */
+	uint64_t reads;
+	uint64_t elapsed;       /* CPU clock cycles taken by the reads */
+	uint64_t sink;
+};
+
+static void pin(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/*
+ * Time batches of back to back reads with the serializing CPU clock reads,
+ * then count how many reads fit in a fixed time, with every thread doing
+ * the same at once. Instantiated for each clock so that the read is inlined.
+ */
+template <uint64_t (*Read)(void)>
+static void *worker_main(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	uint64_t s, e, sum = 0, reads = 0, start, now;
+	int i, j;
+
+	pin(w->cpu);
+
+	pthread_barrier_wait(w->barrier);
+	for (i = 0; i < w->nr_batches; i++) {
+		s = libtime_cpu_start();
+		for (j = 0; j < BATCH; j++)
+			sum += Read();
+		e = libtime_cpu_stop(NULL);
+		w->batches[i] = e - s;
+	}
+
+	pthread_barrier_wait(w->barrier);
+	start = libtime_cpu();
+	do {
+		for (j = 0; j < THROUGHPUT_CHUNK; j++)
+			sum += Read();
+		reads += THROUGHPUT_CHUNK;
+		now = libtime_cpu();
+	} while (now - start < w->budget);
+
+	w->reads = reads;
+	w->elapsed = now - start;
+	w->sink = sum;
+	return NULL;
+}
+
+static uint64_t read_nothing(void)
+{
+	return 0;
+}
+
+template <ClockType Type>
+static uint64_t read_libtime(void)
+{
+	return libtime_read(Type);
+}
+
+template <clockid_t Id>
+static uint64_t read_posix(void)
+{
+	struct timespec ts;
+	clock_gettime(Id, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static uint64_t read_steady(void)
+{
+	return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+static uint64_t read_cpu(void)
+{
+	return libtime_cpu();
+}
+
+struct method {
+	const char *name;
+	void *(*run)(void *);
+	int type;               /* ClockType, or -1 if not a libtime clock */
+};
+
+static const struct method methods[] = {
+	{ "libtime CLOCK_CPU", worker_main<read_libtime<CLOCK_CPU> >, CLOCK_CPU },
+	{ "libtime CLOCK_WALL", worker_main<read_libtime<CLOCK_WALL> >, CLOCK_WALL },
+	{ "libtime CLOCK_WALL_FAST", worker_main<read_libtime<CLOCK_WALL_FAST> >, CLOCK_WALL_FAST },
+	{ "libtime CLOCK_FAST", worker_main<read_libtime<CLOCK_FAST> >, CLOCK_FAST },
+	{ "libtime CLOCK_PRECISE", worker_main<read_libtime<CLOCK_PRECISE> >, CLOCK_PRECISE },
+	{ "CLOCK_MONOTONIC", worker_main<read_posix<CLOCK_MONOTONIC> >, -1 },
+#ifdef CLOCK_MONOTONIC_COARSE
+	{ "CLOCK_MONOTONIC_COARSE", worker_main<read_posix<CLOCK_MONOTONIC_COARSE> >, -1 },
+#endif
+#ifdef CLOCK_MONOTONIC_RAW
+	{ "CLOCK_MONOTONIC_RAW", worker_main<read_posix<CLOCK_MONOTONIC_RAW> >, -1 },
+#endif
+	{ "CLOCK_REALTIME", worker_main<read_posix<CLOCK_REALTIME> >, -1 },
+#ifdef CLOCK_BOOTTIME
+	{ "CLOCK_BOOTTIME", worker_main<read_posix<CLOCK_BOOTTIME> >, -1 },
+#endif
+	{ "std::chrono::steady_clock", worker_main<read_steady>, -1 },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "rdtsc", worker_main<read_cpu>, -1 },
+#else
+	{ "libtime_cpu", worker_main<read_cpu>, -1 },
+#endif
+};
+#define NR_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+struct result {
+	int threads;
+	double p50_ns;          /* Latency of a single read */
+	double p99_ns;
+	double mreads;          /* Millions of reads per second, all threads */
+};
+
+static int cmp_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.999999);
+	return sorted[i < n ? i : n - 1];
+}
+
+/*
+ * Run 'threads' workers, pinned to the first CPUs, and collect all their
+ * batches. Each thread's read rate is taken over its own run, so that
+ * threads which started late or were preempted aren't overcounted, and
+ * the rates are added up in 'mreads'.
+ */
+static int run_workers(void *(*run)(void *), int threads, int nr_cpus, int nr_batches,
+                       uint64_t budget, uint64_t *batches, double *mreads)
+{
+	struct worker *workers;
+	pthread_barrier_t barrier;
+	int t;
+
+	workers = (struct worker *)calloc(threads, sizeof(*workers));
+	if (!workers)
+		return 1;
+	pthread_barrier_init(&barrier, NULL, threads);
+
+	for (t = 0; t < threads; t++) {
+		workers[t].cpu = t % nr_cpus;
+		workers[t].nr_batches = nr_batches;
+		workers[t].budget = budget;
+		workers[t].barrier = &barrier;
+		workers[t].batches = batches + (size_t)t * nr_batches;
+		pthread_create(&workers[t].thread, NULL, run, &workers[t]);
+	}
+
+	*mreads = 0.0;
+	for (t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		if (workers[t].elapsed)
+			*mreads += (double)workers[t].reads * 1000.0 /
+			           (double)libtime_cpu_to_wall(workers[t].elapsed);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(workers);
+	return 0;
+}
+
+static int measure(const struct method *m, int threads, int nr_cpus, int nr_batches,
+                   uint64_t budget, uint64_t overhead, struct result *r)
+{
+	uint64_t *batches;
+	int n = threads * nr_batches;
+
+	batches = (uint64_t *)malloc((size_t)n * sizeof(uint64_t));
+	if (!batches || run_workers(m->run, threads, nr_cpus, nr_batches, budget, batches, &r->mreads)) {
+		free(batches);
+		return 1;
+	}
+
+	qsort(batches, n, sizeof(uint64_t), cmp_uint64);
+	r->threads = threads;
+	r->p50_ns = (double)libtime_cpu_to_wall(percentile(batches, n, 0.5) - overhead) / BATCH;
+	r->p99_ns = (double)libtime_cpu_to_wall(percentile(batches, n, 0.99) - overhead) / BATCH;
+	free(batches);
+	return 0;
+}
+
+/* The cost of timing a batch of nothing, taken off every batch. */
+static uint64_t measure_overhead(int nr_cpus, int nr_batches)
+{
+	uint64_t *batches, overhead = 0;
+	double mreads;
+
+	batches = (uint64_t *)malloc((size_t)nr_batches * sizeof(uint64_t));
+	if (batches && !run_workers(worker_main<read_nothing>, 1, nr_cpus, nr_batches, 0,
+	                            batches, &mreads)) {
+		qsort(batches, nr_batches, sizeof(uint64_t), cmp_uint64);
+		overhead = batches[0];
+	}
+	free(batches);
+	return overhead;
+}
+
+int main(int argc, char **argv)
+{
+	struct result *results, *r;
+	const struct libtime_clock_info *info;
+	uint64_t budget_ns = THROUGHPUT_NS, overhead;
+	int json = 0, nr_batches = NR_BATCHES, nr_cpus, max_threads, nr_counts = 0, i, threads;
+	int counts[32];
+	size_t m;
+
+	nr_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_cpus < 1)
+		nr_cpus = 1;
+	max_threads = nr_cpus;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json")) {
+			json = 1;
+		} else if (!strcmp(argv[i], "--quick")) {
+			budget_ns /= 20;
+			nr_batches /= 10;
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			max_threads = atoi(argv[++i]);
+			if (max_threads < 1)
+				max_threads = 1;
+		}
+	}
+
+	libtime_init();
+
+	/* 1, 2, 4, ... threads, and always the maximum */
+	for (threads = 1; threads < max_threads && nr_counts < 31; threads *= 2)
+		counts[nr_counts++] = threads;
+	counts[nr_counts++] = max_threads;
+
+	overhead = measure_overhead(nr_cpus, nr_batches);
+
+	results = (struct result *)calloc(NR_METHODS * nr_counts, sizeof(*results));
+	if (!results)
+		return 1;
+	for (m = 0; m < NR_METHODS; m++)
+		for (i = 0; i < nr_counts; i++)
+			if (measure(&methods[m], counts[i], nr_cpus, nr_batches,
+			            libtime_wall_to_cpu(budget_ns), overhead, &results[m * nr_counts + i]))
+				return 1;
+
+	if (json) {
+		printf("{\n  \"benchmark\": \"clocks\",\n  \"cpus\": %d,\n  \"results\": [\n", nr_cpus);
+		for (m = 0; m < NR_METHODS; m++) {
+			info = methods[m].type >= 0 ? libtime_clock_info((ClockType)methods[m].type) : NULL;
+			for (i = 0; i < nr_counts; i++) {
+				r = &results[m * nr_counts + i];
+				printf("    {\"clock\": \"%s\", \"source\": \"%s\", \"threads\": %d, "
+				       "\"latency_ns\": {\"p50\": %.2f, \"p99\": %.2f}, "
+				       "\"mreads_per_sec\": {\"per_thread\": %.2f, \"total\": %.2f}}%s\n",
+				       methods[m].name, info ? info->name : methods[m].name, r->threads,
+				       r->p50_ns, r->p99_ns, r->mreads / r->threads, r->mreads,
+				       (m == NR_METHODS - 1 && i == nr_counts - 1) ? "" : ",");
+			}
+		}
+		printf("  ]\n}\n");
+		free(results);
+		return 0;
+	}
+
+	printf("%-26s %-24s %7s %9s %9s %12s %12s\n", "clock", "source", "threads",
+	       "p50 (ns)", "p99 (ns)", "Mreads/s/t", "Mreads/s");
+	for (m = 0; m < NR_METHODS; m++) {
+		info = methods[m].type >= 0 ? libtime_clock_info((ClockType)methods[m].type) : NULL;
+		for (i = 0; i < nr_counts; i++) {
+			r = &results[m * nr_counts + i];
+			printf("%-26s %-24s %7d %9.2f %9.2f %12.2f %12.2f\n",
+			       methods[m].name, info ? info->name : "", r->threads,
+			       r->p50_ns, r->p99_ns, r->mreads / r->threads, r->mreads);
+		}
+	}
+
+	free(results);
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <libtime.h>
+#include <inttypes.h>
+
+#define NR_READS 1000000
+#define NR_RUNS 10
+
+static const char *clock_names[] = {
+	"CLOCK_CPU",
+	"CLOCK_WALL",
+	"CLOCK_WALL_FAST",
+	"CLOCK_FAST",
+	"CLOCK_PRECISE",
+};
+
+/* Read through the function pointer table, the way libtime_read() does when
+ * the clock type isn't a compile-time constant.
+ */
+static uint64_t bench_table(ClockType type)
+{
+	volatile ClockType vtype = type;
+	uint64_t s, e, best = UINT64_MAX, sink = 0;
+	int i, j;
+
+	for (j = 0; j < NR_RUNS; j++) {
+		s = libtime_cpu();
+		for (i = 0; i < NR_READS; i++)
+			sink += (*_libtime_clocks[vtype])();
+		e = libtime_cpu();
+		if (e - s < best)
+			best = e - s;
+	}
+	if (!sink)
+		printf("(unreachable)\n");
+	return best;
+}
+
+#define BENCH_DIRECT(type) \
+static uint64_t bench_direct_##type(void) \
+{ \
+	uint64_t s, e, best = UINT64_MAX, sink = 0; \
+	int i, j; \
+	for (j = 0; j < NR_RUNS; j++) { \
+		s = libtime_cpu(); \
+		for (i = 0; i < NR_READS; i++) \
+			sink += libtime_read(type); \
+		e = libtime_cpu(); \
+		if (e - s < best) \
+			best = e - s; \
+	} \
+	if (!sink) \
+		printf("(unreachable)\n"); \
+	return best; \
+}
+
+BENCH_DIRECT(CLOCK_CPU)
+BENCH_DIRECT(CLOCK_WALL)
+BENCH_DIRECT(CLOCK_WALL_FAST)
+BENCH_DIRECT(CLOCK_FAST)
+BENCH_DIRECT(CLOCK_PRECISE)
+
+int main(int argc, char **argv)
+{
+	uint64_t direct[CLOCK_TYPE_MAX + 1];
+	int type;
+
+	libtime_init();
+
+	direct[CLOCK_CPU] = bench_direct_CLOCK_CPU();
+	direct[CLOCK_WALL] = bench_direct_CLOCK_WALL();
+	direct[CLOCK_WALL_FAST] = bench_direct_CLOCK_WALL_FAST();
+	direct[CLOCK_FAST] = bench_direct_CLOCK_FAST();
+	direct[CLOCK_PRECISE] = bench_direct_CLOCK_PRECISE();
+
+	/* Compare per-read cost of the constant-type path with the table */
+
+	printf("%-16s %12s %12s %12s\n", "clock", "table (ns)", "direct (ns)", "saved (ns)");
+	for (type = 0; type <= CLOCK_TYPE_MAX; type++) {
+		double t = (double)libtime_cpu_to_wall(bench_table((ClockType)type)) / NR_READS;
+		double d = (double)libtime_cpu_to_wall(direct[type]) / NR_READS;
+		printf("%-16s %12.2f %12.2f %12.2f\n", clock_names[type], t, d, t - d);
+	}
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libtime.h>
+#include <inttypes.h>
+
+/* Wall time to spend on each duration, and the bounds on iterations */
+#define BUDGET_NS 200000000ULL
+#define MIN_ITERS 5
+#define MAX_ITERS 2000
+
+/* Where the naive hybrid stops sleeping and starts spinning */
+#define HYBRID_SPIN_NS 100000
+
+static const int64_t durations[] = {
+	100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+#define NR_DURATIONS (sizeof(durations) / sizeof(durations[0]))
+
+static void sleep_libtime(int64_t ns)
+{
+	libtime_nanosleep(ns);
+}
+
+static void sleep_until_libtime(int64_t ns)
+{
+	libtime_sleep_until(libtime_read(CLOCK_WALL) + ns, CLOCK_WALL);
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_clock_nanosleep(int64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts))
+		;
+}
+
+/* The usual hand-rolled hybrid: sleep for most of it, then busy-wait */
+static void sleep_hybrid(int64_t ns)
+{
+	uint64_t deadline = monotonic_ns() + ns;
+	if (ns > HYBRID_SPIN_NS)
+		sleep_clock_nanosleep(ns - HYBRID_SPIN_NS);
+	while (monotonic_ns() < deadline)
+		;
+}
+
+struct method {
+	const char *name;
+	void (*sleep)(int64_t ns);
+	int adaptive;
+	int low_slack;
+};
+
+static const struct method methods[] = {
+	{ "libtime_nanosleep", sleep_libtime, 0, 0 },
+	{ "libtime_nanosleep_adaptive", sleep_libtime, 1, 0 },
+	{ "libtime_nanosleep_low_slack", sleep_libtime, 0, 1 },
+	{ "libtime_sleep_until", sleep_until_libtime, 0, 0 },
+	{ "clock_nanosleep", sleep_clock_nanosleep, 0, 0 },
+	{ "hybrid_spin", sleep_hybrid, 0, 0 },
+};
+#define NR_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+struct result {
+	int iters;
+	int early;
+	int64_t min, p50, p99, p999, max;
+	double cpu_ns;
+};
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+	int64_t l = *(const int64_t *)a, r = *(const int64_t *)b;
+	return (l > r) - (l < r);
+}
+
+static int64_t percentile(const int64_t *sorted, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.999999);
+	return sorted[i < n ? i : n - 1];
+}
+
+static void run(const struct method *m, int64_t ns, uint64_t budget, struct result *r)
+{
+	int64_t *over;
+	uint64_t s, e, cpu;
+	int i;
+
+	r->iters = (int)(budget / (uint64_t)ns);
+	if (r->iters < MIN_ITERS)
+		r->iters = MIN_ITERS;
+	if (r->iters > MAX_ITERS)
+		r->iters = MAX_ITERS;
+	over = malloc(r->iters * sizeof(int64_t));
+
+	libtime_sleep_adaptive(m->adaptive);
+	if (m->low_slack)
+		libtime_set_timer_slack(1);
+	r->early = 0;
+	cpu = thread_cpu_ns();
+	for (i = 0; i < r->iters; i++) {
+		s = libtime_cpu();
+		m->sleep(ns);
+		e = libtime_cpu();
+		over[i] = (int64_t)libtime_cpu_to_wall(e - s) - ns;
+		if (over[i] < 0)
+			r->early++;
+	}
+	r->cpu_ns = (double)(thread_cpu_ns() - cpu) / r->iters;
+	libtime_sleep_adaptive(0);
+	if (m->low_slack)
+		libtime_set_timer_slack(0);
+
+	qsort(over, r->iters, sizeof(int64_t), cmp_int64);
+	r->min = over[0];
+	r->p50 = percentile(over, r->iters, 0.5);
+	r->p99 = percentile(over, r->iters, 0.99);
+	r->p999 = percentile(over, r->iters, 0.999);
+	r->max = over[r->iters - 1];
+	free(over);
+}
+
+int main(int argc, char **argv)
+{
+	struct result results[NR_METHODS][NR_DURATIONS], *r;
+	uint64_t budget = BUDGET_NS;
+	int json = 0, i;
+	size_t m, d;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json"))
+			json = 1;
+		else if (!strcmp(argv[i], "--quick"))
+			budget /= 20;
+	}
+
+	libtime_init();
+
+	for (m = 0; m < NR_METHODS; m++)
+		for (d = 0; d < NR_DURATIONS; d++)
+			run(&methods[m], durations[d], budget, &results[m][d]);
+
+	if (json) {
+		printf("{\n  \"benchmark\": \"sleep\",\n  \"results\": [\n");
+		for (m = 0; m < NR_METHODS; m++) {
+			for (d = 0; d < NR_DURATIONS; d++) {
+				r = &results[m][d];
+				printf("    {\"method\": \"%s\", \"requested_ns\": %" PRId64 ", "
+				       "\"iterations\": %d, \"early\": %d, "
+				       "\"overshoot_ns\": {\"min\": %" PRId64 ", \"p50\": %" PRId64 ", "
+				       "\"p99\": %" PRId64 ", \"p99.9\": %" PRId64 ", \"max\": %" PRId64 "}, "
+				       "\"cpu_ns_per_call\": %.0f}%s\n",
+				       methods[m].name, durations[d], r->iters, r->early,
+				       r->min, r->p50, r->p99, r->p999, r->max, r->cpu_ns,
+				       (m == NR_METHODS - 1 && d == NR_DURATIONS - 1) ? "" : ",");
+			}
+		}
+		printf("  ]\n}\n");
+		return 0;
+	}
+
+	printf("%-28s %10s %6s %10s %10s %10s %10s %10s %8s\n", "method", "ns", "early",
+	       "min", "p50", "p99", "p99.9", "max", "cpu %");
+	for (m = 0; m < NR_METHODS; m++) {
+		for (d = 0; d < NR_DURATIONS; d++) {
+			r = &results[m][d];
+			printf("%-28s %10" PRId64 " %6d %10" PRId64 " %10" PRId64 " %10" PRId64
+			       " %10" PRId64 " %10" PRId64 " %8.1f\n",
+			       methods[m].name, durations[d], r->early, r->min, r->p50, r->p99,
+			       r->p999, r->max, 100.0 * r->cpu_ns / (durations[d] + r->p50));
+		}
+	}
+
+	return 0;
+}
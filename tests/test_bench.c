@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <libtime.h>
+#include <libtime_bench.h>
+#include <inttypes.h>
+
+/* A dependent chain of multiply-adds, 'len' long per iteration */
+static void chain(void *arg, uint64_t iters)
+{
+	uint64_t len = *(uint64_t *)arg, x = iters, i, j;
+
+	for (i = 0; i < iters; i++)
+		for (j = 0; j < len; j++)
+			x = x * 3 + 1;
+	libtime_bench_use(x);
+}
+
+static void empty(void *arg, uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++)
+		libtime_bench_use(i);
+}
+
+/* Ignores the iteration count, so it can never be timed */
+static void constant(void *arg, uint64_t iters)
+{
+	libtime_bench_use(iters);
+}
+
+static int check_result(const struct libtime_bench_result *r)
+{
+	double ns_per_cycle = (double)libtime_cpu_to_wall(1000000000ULL) / 1e9;
+	int failures = 0;
+
+	printf("%-12s %10" PRIu64 " iters, %2u/%2u kept, %8.3f +- %.3f cycles, %8.3f +- %.3f ns\n",
+	       r->name, r->iters, r->kept, r->samples, r->cycles, r->cycles_ci, r->ns, r->ns_ci);
+
+	if (!r->iters || !r->kept || r->kept > r->samples)
+		failures++;
+	if (r->cycles < 0 || r->cycles_ci < 0 || r->cycles_stddev < 0 || r->overhead < 0)
+		failures++;
+	if (r->ns < r->cycles * ns_per_cycle * 0.999 || r->ns > r->cycles * ns_per_cycle * 1.001 + 1e-9)
+		failures++;
+	if (failures)
+		printf("  implausible result\n");
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_bench_config config = { 1000000, 10000000, 20 };
+	struct libtime_bench_result results[3], constant_result;
+	uint64_t short_len = 100, long_len = 1000;
+	double ratio;
+	char buf[4096];
+	FILE *f;
+	size_t len;
+	int failures = 0, i;
+
+	libtime_init();
+
+	if (libtime_bench_run("empty", empty, NULL, &config, &results[0]) ||
+	    libtime_bench_run("chain_100", chain, &short_len, &config, &results[1]) ||
+	    libtime_bench_run("chain_1000", chain, &long_len, NULL, &results[2]))
+		return 1;
+	for (i = 0; i < 3; i++)
+		failures += check_result(&results[i]);
+
+	/* Ten times the work should take about ten times as long. */
+	ratio = results[2].cycles / results[1].cycles;
+	printf("chain_1000 / chain_100: %.2f\n", ratio);
+	if (ratio < 5.0 || ratio > 15.0) {
+		printf("  work doesn't scale\n");
+		failures++;
+	}
+
+	if (results[0].cycles > results[1].cycles / 10) {
+		printf("  empty loop too expensive, overhead not subtracted?\n");
+		failures++;
+	}
+
+	if (!libtime_bench_run("constant", constant, NULL, &config, &constant_result)) {
+		printf("  constant kernel accepted\n");
+		failures++;
+	}
+
+	f = tmpfile();
+	if (!f || libtime_bench_json(f, results, 3))
+		return 1;
+	rewind(f);
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[len] = 0;
+	fclose(f);
+	printf("%s", buf);
+	if (buf[0] != '[' || !strstr(buf, "\"name\": \"chain_1000\"") ||
+	    !strstr(buf, "\"ns_per_op_ci95\"") || strcmp(buf + len - 2, "]\n")) {
+		printf("  malformed JSON\n");
+		failures++;
+	}
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
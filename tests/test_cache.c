@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <libtime.h>
+#include "libtime_internal.h"
+#include <inttypes.h>
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+#include <cpuid.h>
+#include "test_common.h"
+#endif
+
+static char path[256];
+
+static int read_cache(struct libtime_cache_file *file)
+{
+	FILE *f = fopen(path, "rb");
+	size_t r;
+
+	if (!f)
+		return 1;
+	r = fread(file, 1, sizeof(*file), f);
+	fclose(f);
+	return r != sizeof(*file);
+}
+
+/* Write 'len' bytes of 'file', optionally with a freshly computed checksum */
+static void write_cache(struct libtime_cache_file *file, size_t len, int fix_checksum)
+{
+	FILE *f;
+
+	if (fix_checksum)
+		file->checksum = libtime_cache_checksum(file);
+	unlink(path);
+	f = fopen(path, "wb");
+	fwrite(file, 1, len, f);
+	fclose(f);
+	chmod(path, 0600);
+}
+
+/*
+ * Run in a fresh process, since a process with parameters already live keeps
+ * its own timeline. The loaded rate must give the timeline a cold init with
+ * that rate would, counting from zero.
+ */
+static int load_child(void)
+{
+	struct libtime_calibration cal;
+	struct libtime_cpu_conv conv;
+	uint64_t s, e, ns;
+
+	if (libtime_cache_load(&cal))
+		return 2;
+	libtime_init_flags(LIBTIME_INIT_CACHE);
+	_libtime_cpu_conv_read(&conv);
+	if (conv.clock_mult != cal.cpu.clock_mult || conv.clock_shift != cal.cpu.clock_shift)
+		return 3;
+
+	s = libtime_cpu();
+	ns = libtime_cpu_ns();
+	e = libtime_cpu();
+	if (ns < _libtime_cpu_scale(&conv, s) || ns > _libtime_cpu_scale(&conv, e)) {
+		printf("libtime_cpu_ns() = %" PRIu64 ", expected %" PRIu64 " to %" PRIu64 "\n",
+		       ns, _libtime_cpu_scale(&conv, s), _libtime_cpu_scale(&conv, e));
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_calibration cal, loaded;
+	struct libtime_cache_file good, file;
+	struct libtime_cache_key key;
+	struct libtime_cpu_conv conv;
+	pid_t pid;
+	int status;
+	char dir[] = "/tmp/test_cache.XXXXXX";
+
+	if (argc > 1 && !strcmp(argv[1], "--load"))
+		return load_child();
+
+	if (!mkdtemp(dir))
+		return 1;
+	snprintf(path, sizeof(path), "%s/libtime.cache", dir);
+	setenv("LIBTIME_CACHE", path, 1);
+
+	libtime_init();
+
+	memset(&cal, 0, sizeof(cal));
+	cal.cpu = _libtime_cpu_conv;
+	cal.max_sleep_ns = 12345;
+	cal.sleep_overhead_clk = 678;
+
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	libtime_cache_store(&cal);
+	memset(&loaded, 0, sizeof(loaded));
+	CHECK(libtime_cache_load(&loaded) == 0);
+	CHECK(loaded.max_sleep_ns == cal.max_sleep_ns &&
+	      loaded.sleep_overhead_clk == cal.sleep_overhead_clk &&
+	      loaded.cpu.clock_mult == cal.cpu.clock_mult &&
+	      loaded.cpu.cycles_per_msec == cal.cpu.cycles_per_msec);
+
+	CHECK(libtime_cache_key(&key) == 0);
+	CHECK(read_cache(&good) == 0);
+	CHECK(!memcmp(&good.key, &key, sizeof(key)));
+
+#if defined(TARGET_CPU_X86) || defined(TARGET_CPU_X86_64)
+	{
+		unsigned int a, b, c, d, max_ext, flags;
+
+		__cpuid(1, a, b, c, d);
+		flags = d & (1 << 4);
+		__cpuid(0x80000000, max_ext, b, c, d);
+		if (max_ext >= 0x80000007) {
+			__cpuid(0x80000001, a, b, c, d);
+			flags |= d & (1 << 27);
+			__cpuid(0x80000007, a, b, c, d);
+			flags |= d & (1 << 8);
+		}
+		printf("tsc_flags: %#x, expected %#x\n", key.tsc_flags, flags);
+		CHECK(key.tsc_flags == flags);
+	}
+#endif
+
+	/* Rewriting it unchanged must still load, so the rejections below are real */
+	file = good;
+	write_cache(&file, sizeof(file), 1);
+	CHECK(libtime_cache_load(&loaded) == 0);
+
+	file = good;
+	file.cal.max_sleep_ns ^= 1;
+	write_cache(&file, sizeof(file), 0);
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	file = good;
+	write_cache(&file, sizeof(file) - 8, 0);
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	file = good;
+	file.version++;
+	write_cache(&file, sizeof(file), 1);
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	file = good;
+	file.key.boot_id[0] ^= 1;
+	write_cache(&file, sizeof(file), 1);
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	file = good;
+	file.key.tsc_flags ^= 1 << 8;
+	write_cache(&file, sizeof(file), 1);
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	file = good;
+	write_cache(&file, sizeof(file), 1);
+	chmod(path, 0666);
+	CHECK(libtime_cache_load(&loaded) != 0);
+
+	/*
+	 * Move the timeline off a cold init's, as libtime_drift_start()
+	 * would, and have libtime_init() save the calibration.
+	 */
+	unlink(path);
+	_libtime_cpu_conv_read(&conv);
+	libtime_cpu_set_rate(conv.cycles_per_msec * 1001, 1000000ULL * 1000);
+	usleep(100000);
+	libtime_init_flags(LIBTIME_INIT_CACHE);
+	CHECK(read_cache(&file) == 0);
+	CHECK(!file.cal.cpu.base_cycles && !file.cal.cpu.base_nsecs);
+
+	fflush(stdout);
+	pid = fork();
+	if (!pid) {
+		execl(argv[0], argv[0], "--load", (char *)NULL);
+		_exit(127);
+	}
+	status = -1;
+	if (pid > 0)
+		waitpid(pid, &status, 0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	unlink(path);
+	rmdir(dir);
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
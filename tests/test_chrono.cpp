@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <libtime.hpp>
+#include "test_common.h"
+
+using namespace std::chrono;
+
+#define SLEEP_NS 1000000
+
+template <class Clock>
+static void check_clock(const char *name)
+{
+	typename Clock::time_point s, e;
+	nanoseconds elapsed;
+
+	static_assert(Clock::is_steady, "clock should be steady");
+
+	s = Clock::now();
+	libtime_nanosleep(SLEEP_NS);
+	e = Clock::now();
+	elapsed = e - s;
+
+	printf("%-14s slept %lld ns\n", name, (long long)elapsed.count());
+	CHECK(e > s);
+	CHECK(elapsed >= nanoseconds(SLEEP_NS));
+	CHECK(duration_cast<milliseconds>(e - s) < milliseconds(100));
+}
+
+int main(int argc, char **argv)
+{
+	libtime::tsc_clock::time_point s, e;
+	libtime::tsc_clock::duration d;
+	uint64_t raw_s, raw_e;
+	nanoseconds ns;
+
+	libtime_init();
+
+	check_clock<libtime::tsc_clock>("tsc_clock");
+	check_clock<libtime::fast_clock>("fast_clock");
+	check_clock<libtime::precise_clock>("precise_clock");
+
+	/* Differences stay in raw cycles until converted */
+	raw_s = libtime_cpu();
+	s = libtime::tsc_clock::now();
+	e = libtime::tsc_clock::now();
+	raw_e = libtime_cpu();
+	d = e - s;
+	CHECK(d.count().raw() >= 0);
+	CHECK((uint64_t)d.count().raw() <= raw_e - raw_s);
+	ns = d;
+	CHECK(ns.count() == (int64_t)libtime_cpu_to_wall(d.count().raw()));
+	CHECK(-ns == nanoseconds(s - e));
+
+	/* Nanoseconds to cycles and back */
+	d = duration_cast<libtime::tsc_clock::duration>(milliseconds(5));
+	CHECK(d.count().raw() == (int64_t)libtime_wall_to_cpu(5000000));
+	ns = duration_cast<nanoseconds>(d);
+	CHECK(ns >= nanoseconds(4999999) && ns <= nanoseconds(5000001));
+	CHECK(duration_cast<microseconds>(d) >= microseconds(4999) &&
+	      duration_cast<microseconds>(d) <= microseconds(5000));
+	CHECK(d * 2 >= milliseconds(10) - nanoseconds(2));
+	CHECK(s + d > s);
+	CHECK(libtime::tsc_clock::duration::zero().count().raw() == 0);
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
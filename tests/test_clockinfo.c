@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <libtime.h>
+#include <inttypes.h>
+
+static const char *clock_names[] = {
+	"CLOCK_CPU",
+	"CLOCK_WALL",
+	"CLOCK_WALL_FAST",
+	"CLOCK_FAST",
+	"CLOCK_PRECISE",
+};
+
+int main(int argc, char **argv)
+{
+	const struct libtime_clock_info *info;
+	uint64_t a, b;
+	int failures = 0, type;
+
+	libtime_init();
+
+	printf("%-16s %-24s %10s %10s %12s %10s\n",
+	       "clock", "source", "min (ns)", "med (ns)", "res (ns)", "backwards");
+	for (type = 0; type <= CLOCK_TYPE_MAX; type++) {
+		info = libtime_clock_info((ClockType)type);
+		if (!info || !info->name) {
+			printf("%-16s no information\n", clock_names[type]);
+			failures++;
+			continue;
+		}
+		printf("%-16s %-24s %10" PRIu64 " %10" PRIu64 " %12" PRIu64 " %10" PRIu64 "\n",
+		       clock_names[type], info->name,
+		       libtime_cpu_to_wall(info->cost_min), libtime_cpu_to_wall(info->cost_median),
+		       info->resolution_ns, info->backwards);
+
+		if (!info->cost_median || info->cost_min > info->cost_median || !info->resolution_ns) {
+			printf("  implausible measurement\n");
+			failures++;
+		}
+
+		a = libtime_read((ClockType)type);
+		b = libtime_read((ClockType)type);
+		if (b < a) {
+			printf("  went backwards\n");
+			failures++;
+		}
+	}
+
+	info = libtime_clock_info(CLOCK_WALL);
+	if (info && (info->resolution_ns > 1000 || info->backwards)) {
+		printf("CLOCK_WALL is coarse or not monotonic\n");
+		failures++;
+	}
+	if (info && info != libtime_clock_info(CLOCK_PRECISE)) {
+		printf("CLOCK_PRECISE doesn't share CLOCK_WALL's source\n");
+		failures++;
+	}
+	if (libtime_clock_info((ClockType)(CLOCK_TYPE_MAX + 1))) {
+		printf("invalid clock type accepted\n");
+		failures++;
+	}
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
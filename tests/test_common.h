@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+static int failures;
+
+/* Count and report a failed check, carrying on with the rest of the test. */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <libtime.h>
+#include <libtime_counter.h>
+#include <inttypes.h>
+#include "test_common.h"
+
+#define NR_THREADS 4
+#define NR_ITERS 1000000
+#define NR_MANY 300
+#define NR_MANY_ITERS 100
+
+static struct libtime_counter *counter;
+static pthread_barrier_t barrier;
+static volatile int workers_done;
+
+/* Thread t adds durations of 1000 to 100000 cycles, scaled by t + 1. */
+static uint64_t duration(int t, int i)
+{
+	return (uint64_t)(i % 100 + 1) * 1000 * (t + 1);
+}
+
+static void *worker(void *arg)
+{
+	int t = (int)(intptr_t)arg, i;
+
+	for (i = 0; i < NR_ITERS; i++)
+		libtime_counter_add(counter, duration(t, i));
+	return NULL;
+}
+
+static void *many_worker(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NR_MANY_ITERS; i++)
+		libtime_counter_add(counter, 1000);
+
+	/* Keep everyone alive at once, so that the slots run out. */
+	pthread_barrier_wait(&barrier);
+	return NULL;
+}
+
+/* Adds from a thread-specific data destructor, which may run after the
+ * thread has given its slot back.
+ */
+static pthread_key_t late_key;
+
+static void late_add(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NR_MANY_ITERS; i++)
+		libtime_counter_add(counter, 1000);
+}
+
+static void *late_worker(void *arg)
+{
+	libtime_counter_add(counter, 1000);
+	pthread_setspecific(late_key, counter);
+	return NULL;
+}
+
+static int near(uint64_t got, double want)
+{
+	return fabs((double)got - want) <= want * 0.001 + 2;
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_counter_stats st;
+	pthread_t threads[NR_MANY];
+	uint64_t last_count = 0, s, e, sum = 0, reads = 0;
+	double mean = 0, m2 = 0, delta, x;
+	int torn = 0, t, i;
+
+	libtime_init();
+
+	counter = libtime_counter_create();
+	if (!counter)
+		return 1;
+
+	libtime_counter_read(counter, &st);
+	CHECK(!st.count && !st.total_ns && !st.max_ns);
+
+	/* One thread, durations 1000..100000 */
+	for (i = 0; i < 100; i++)
+		libtime_counter_add(counter, duration(0, i));
+	libtime_counter_read(counter, &st);
+	CHECK(st.count == 100);
+	CHECK(st.total_ns == libtime_cpu_to_wall(5050000));
+	CHECK(st.min_ns == libtime_cpu_to_wall(1000));
+	CHECK(st.max_ns == libtime_cpu_to_wall(100000));
+	CHECK(near(st.mean_ns, libtime_cpu_to_wall(50500)));
+	CHECK(near(st.stddev_ns, libtime_cpu_to_wall(29011) + 0.1));
+	libtime_counter_destroy(counter);
+
+	/* Several threads, read while they're adding */
+	counter = libtime_counter_create();
+	workers_done = 0;
+	for (t = 0; t < NR_THREADS; t++)
+		pthread_create(&threads[t], NULL, worker, (void *)(intptr_t)t);
+	for (i = 0; i < 1000; i++) {
+		libtime_counter_read(counter, &st);
+		if (st.count < last_count || (st.count && (st.mean_ns < st.min_ns || st.mean_ns > st.max_ns)))
+			torn++;
+		last_count = st.count;
+		reads++;
+	}
+	for (t = 0; t < NR_THREADS; t++)
+		pthread_join(threads[t], NULL);
+
+	for (t = 0; t < NR_THREADS; t++) {
+		for (i = 0; i < NR_ITERS; i++) {
+			x = (double)duration(t, i);
+			sum += duration(t, i);
+			delta = x - mean;
+			mean += delta / (double)((uint64_t)t * NR_ITERS + i + 1);
+			m2 += delta * (x - mean);
+		}
+	}
+
+	libtime_counter_read(counter, &st);
+	CHECK(!torn);
+	CHECK(st.count == (uint64_t)NR_THREADS * NR_ITERS);
+	CHECK(st.total_ns == libtime_cpu_to_wall(sum));
+	CHECK(st.min_ns == libtime_cpu_to_wall(1000));
+	CHECK(st.max_ns == libtime_cpu_to_wall(100000 * NR_THREADS));
+	CHECK(near(st.mean_ns, libtime_cpu_to_wall((uint64_t)mean)));
+	CHECK(near(st.stddev_ns, libtime_cpu_to_wall((uint64_t)sqrt(m2 / (st.count - 1)))));
+	libtime_counter_destroy(counter);
+
+	/* More threads than there are shards, twice, so slots get reused */
+	counter = libtime_counter_create();
+	pthread_barrier_init(&barrier, NULL, NR_MANY);
+	for (i = 0; i < 2; i++) {
+		for (t = 0; t < NR_MANY; t++)
+			pthread_create(&threads[t], NULL, many_worker, NULL);
+		for (t = 0; t < NR_MANY; t++)
+			pthread_join(threads[t], NULL);
+	}
+	pthread_barrier_destroy(&barrier);
+	libtime_counter_read(counter, &st);
+	CHECK(st.count == 2 * NR_MANY * NR_MANY_ITERS);
+	CHECK(st.stddev_ns == 0);
+	libtime_counter_destroy(counter);
+
+	/* Adds after the slot is handed back go to the overflow shard, so
+	 * they're neither lost nor racing with the slot's next owner.
+	 */
+	counter = libtime_counter_create();
+	pthread_key_create(&late_key, late_add);
+	for (i = 0; i < 2; i++) {
+		for (t = 0; t < NR_THREADS; t++)
+			pthread_create(&threads[t], NULL, late_worker, NULL);
+		for (t = 0; t < NR_THREADS; t++)
+			pthread_join(threads[t], NULL);
+	}
+	pthread_key_delete(late_key);
+	libtime_counter_read(counter, &st);
+	CHECK(st.count == 2 * NR_THREADS * (NR_MANY_ITERS + 1));
+	libtime_counter_destroy(counter);
+
+	/* Cost of an add from one thread */
+	counter = libtime_counter_create();
+	s = libtime_cpu();
+	for (i = 0; i < NR_ITERS; i++)
+		libtime_counter_add(counter, i);
+	e = libtime_cpu();
+	printf("add: %.2f ns\n", (double)libtime_cpu_to_wall(e - s) / NR_ITERS);
+	libtime_counter_destroy(counter);
+
+	printf("%" PRIu64 " reads during adds, %d failures\n", reads, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libtime.h>
+#include "libtime_internal.h"
+#include <inttypes.h>
+#include "test_common.h"
+
+/* Published rate error, making libtime_cpu_ns() run slow */
+#define OFF_PPM 100
+#define INTERVAL_NS 100000000ULL
+#define RUN_MS 2500
+#define SAMPLE_MS 10
+
+/* Offset from the starting one that must have built up, and what must be
+ * left of it by the end.
+ */
+#define MIN_PEAK_NS 50000
+#define MAX_FINAL_NS 20000
+
+static volatile int reader_stop;
+static uint64_t reader_reads, reader_backwards;
+
+static void *reader(void *arg)
+{
+	uint64_t last = libtime_cpu_ns(), now;
+
+	while (!reader_stop) {
+		now = libtime_cpu_ns();
+		if (now < last)
+			reader_backwards++;
+		last = now;
+		reader_reads++;
+	}
+	return NULL;
+}
+
+/* libtime_cpu_ns() - libtime_wall(), from the tightest of a few brackets */
+static int64_t offset(void)
+{
+	uint64_t s, e, w, best = UINT64_MAX;
+	int64_t off = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		s = libtime_cpu_ns();
+		w = libtime_wall();
+		e = libtime_cpu_ns();
+		if (e - s < best) {
+			best = e - s;
+			off = (int64_t)(s + (e - s) / 2 - w);
+		}
+	}
+	return off;
+}
+
+static void set_off_rate(void)
+{
+	struct libtime_cpu_conv conv;
+
+	_libtime_cpu_conv_read(&conv);
+	libtime_cpu_set_rate(conv.cycles_per_msec * (1000000 + OFF_PPM), 1000000ULL * 1000000);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t thread;
+	int64_t off0, err, peak = 0, step;
+	uint64_t s, e, allowed;
+	int i;
+
+	libtime_init();
+	pthread_create(&thread, NULL, reader, NULL);
+
+	/*
+	 * A second libtime_init() replaces the rate, but must carry on from
+	 * wherever libtime_cpu_ns() has got to. Only the rate error during the
+	 * re-init itself may show.
+	 */
+	set_off_rate();
+	usleep(500000);
+	off0 = offset();
+	s = libtime_wall();
+	libtime_init_flags(0);
+	e = libtime_wall();
+	step = offset() - off0;
+	allowed = 10000 + (e - s) * (OFF_PPM + 50) / 1000000;
+	printf("re-init took %" PRIu64 " us, stepped %" PRId64 " ns\n", (e - s) / 1000, step);
+	CHECK((uint64_t)llabs(step) <= allowed);
+
+	/* The drift thread should work the offset off again. */
+	set_off_rate();
+	off0 = offset();
+	if (libtime_drift_start(INTERVAL_NS))
+		return 1;
+	for (i = 0; i < RUN_MS / SAMPLE_MS; i++) {
+		usleep(SAMPLE_MS * 1000);
+		err = offset() - off0;
+		if (llabs(err) > peak)
+			peak = llabs(err);
+	}
+	printf("peak offset %" PRId64 " ns, final %" PRId64 " ns\n", peak, err);
+	CHECK(peak >= MIN_PEAK_NS);
+	CHECK(llabs(err) <= MAX_FINAL_NS);
+
+	/* Re-init with the drift thread running */
+	libtime_init_flags(0);
+	usleep(2 * INTERVAL_NS / 1000);
+	libtime_drift_stop();
+
+	reader_stop = 1;
+	pthread_join(thread, NULL);
+	printf("%" PRIu64 " concurrent reads\n", reader_reads);
+	CHECK(!reader_backwards);
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <libtime.h>
+#include <libtime_hist.h>
+#include <inttypes.h>
+#include "test_common.h"
+
+#define NR_THREADS 4
+#define NR_RECORDS 1000000
+#define NR_VALUES 2000
+#define MAX_NS 10000000000ULL
+
+static struct libtime_hist *thread_hists[NR_THREADS];
+static volatile int running;
+
+static void *worker(void *arg)
+{
+	struct libtime_hist *h = arg;
+	uint64_t i;
+
+	for (i = 0; i < NR_RECORDS; i++)
+		libtime_hist_record(h, (i * 7919) & 0xfffff);
+	return NULL;
+}
+
+/* Within the precision promised for 3 digits, plus rounding in conversion */
+static int close_to(uint64_t got, uint64_t want)
+{
+	return got + 1 >= want && got <= want + want / 1000 + 1;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[NR_THREADS];
+	struct libtime_hist *h, *merged, *coarse;
+	uint64_t i, v, s, e, last, count, bad = 0;
+	int t;
+
+	libtime_init();
+	srand(1);
+
+	h = libtime_hist_create(MAX_NS, 3);
+	CHECK(h != NULL);
+	CHECK(libtime_hist_create(MAX_NS, 0) == NULL);
+	CHECK(libtime_hist_percentile(h, 50.0) == 0);
+
+	/* A single value comes back as the top of its sub-bucket */
+	for (i = 0; i < NR_VALUES; i++) {
+		v = ((uint64_t)rand() << (rand() % 24)) % libtime_wall_to_cpu(MAX_NS);
+		libtime_hist_reset(h);
+		libtime_hist_record(h, v);
+		if (!close_to(libtime_hist_percentile(h, 100.0), libtime_cpu_to_wall(v)))
+			bad++;
+	}
+	CHECK(bad == 0);
+
+	/* Anything past the range is counted at the top */
+	libtime_hist_reset(h);
+	libtime_hist_record(h, UINT64_MAX);
+	CHECK(close_to(libtime_hist_percentile(h, 100.0), MAX_NS));
+
+	/* A uniform distribution from 1 to 100us */
+	libtime_hist_reset(h);
+	for (v = 1; v <= 100000; v++)
+		libtime_hist_record(h, libtime_wall_to_cpu(v));
+	printf("uniform 1-100000 ns: p50 %" PRIu64 ", p99 %" PRIu64 ", p100 %" PRIu64 ", mean %" PRIu64 "\n",
+	       libtime_hist_percentile(h, 50.0), libtime_hist_percentile(h, 99.0),
+	       libtime_hist_percentile(h, 100.0), libtime_hist_mean(h));
+	CHECK(libtime_hist_count(h) == 100000);
+	CHECK(close_to(libtime_hist_percentile(h, 50.0), 50000));
+	CHECK(close_to(libtime_hist_percentile(h, 99.0), 99000));
+	CHECK(close_to(libtime_hist_percentile(h, 100.0), 100000));
+	CHECK(close_to(libtime_hist_mean(h), 50000));
+
+	/* One histogram per thread, merged while they're recording */
+	merged = libtime_hist_create(MAX_NS, 3);
+	for (t = 0; t < NR_THREADS; t++) {
+		thread_hists[t] = libtime_hist_create(MAX_NS, 3);
+		pthread_create(&threads[t], NULL, worker, thread_hists[t]);
+	}
+	last = 0;
+	for (i = 0; i < 20; i++) {
+		libtime_hist_reset(merged);
+		for (t = 0; t < NR_THREADS; t++)
+			libtime_hist_merge(merged, thread_hists[t]);
+		count = libtime_hist_count(merged);
+		CHECK(count >= last);
+		last = count;
+		libtime_nanosleep(1000000);
+	}
+	for (t = 0; t < NR_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	libtime_hist_reset(merged);
+	for (t = 0; t < NR_THREADS; t++)
+		CHECK(libtime_hist_merge(merged, thread_hists[t]) == 0);
+	CHECK(libtime_hist_count(merged) == (uint64_t)NR_THREADS * NR_RECORDS);
+
+	coarse = libtime_hist_create(MAX_NS, 2);
+	CHECK(libtime_hist_merge(merged, coarse) != 0);
+
+	/* Cost of a record */
+	libtime_hist_reset(h);
+	s = libtime_cpu();
+	for (i = 0; i < NR_RECORDS; i++)
+		libtime_hist_record(h, i & 0xffff);
+	e = libtime_cpu();
+	printf("record: %.2f ns\n", (double)libtime_cpu_to_wall(e - s) / NR_RECORDS);
+
+	for (t = 0; t < NR_THREADS; t++)
+		libtime_hist_destroy(thread_hists[t]);
+	libtime_hist_destroy(coarse);
+	libtime_hist_destroy(merged);
+	libtime_hist_destroy(h);
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <libtime.h>
+#include "libtime_internal.h"
+#include <inttypes.h>
+
+#define NR_RANDOM 1000000
+#define NR_VALUES (64 * 3 + 1 + NR_RANDOM)
+
+static int failures;
+
+static const struct {
+	const char *name;
+	enum libtime_batch_kernel kernel;
+} kernels[] = {
+	{ "scalar", LIBTIME_BATCH_SCALAR },
+	{ "AVX2", LIBTIME_BATCH_AVX2 },
+	{ "AVX-512", LIBTIME_BATCH_AVX512 },
+};
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* Check a conversion result against 'ref', computed straight from the
+ * calibrated rate rather than the engine's fixed point. 'mult' is within one
+ * unit of the exact ratio and cycles_per_msec within one cycle, so each
+ * allows that much relative error, plus one for truncating the result.
+ * Anything that may be past the top of the range can also saturate.
+ */
+static void check(const char *what, uint64_t x, long double ref, uint64_t mult,
+                  uint64_t cycles_per_msec, uint64_t got)
+{
+	long double tol = ref * (1.0L / mult + 1.0L / cycles_per_msec) + 1.0L;
+
+	if (got >= UINT64_MAX - 1 && ref + tol >= 18446744073709551614.0L)
+		return;
+	if ((long double)got >= ref - tol && (long double)got <= ref + tol)
+		return;
+
+	if (failures++ < 10)
+		printf("%s(%" PRIu64 ") = %" PRIu64 ", expected %.0Lf\n", what, x, got, ref);
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_cpu_conv conv;
+	uint64_t *values, *batch, state = 0x9e3779b97f4a7c15ULL;
+	uint64_t x, y, slack;
+	size_t i, n = 0;
+	int k;
+
+	libtime_init();
+	_libtime_cpu_conv_read(&conv);
+
+	printf("clock_mult=%" PRIu64 " clock_shift=%u\n", conv.clock_mult, conv.clock_shift);
+	printf("cycles_mult=%" PRIu64 " cycles_shift=%u\n", conv.cycles_mult, conv.cycles_shift);
+
+	values = malloc(NR_VALUES * sizeof(uint64_t));
+	batch = malloc(NR_VALUES * sizeof(uint64_t));
+	if (!values || !batch)
+		return 1;
+
+	/* Every power of two and its neighbours, then random magnitudes */
+	for (k = 0; k < 64; k++) {
+		values[n++] = (1ULL << k) - 1;
+		values[n++] = 1ULL << k;
+		values[n++] = (1ULL << k) + 1;
+	}
+	values[n++] = UINT64_MAX;
+	for (i = 0; i < NR_RANDOM; i++)
+		values[n++] = xorshift64(&state) >> (xorshift64(&state) & 63);
+
+	for (i = 0; i < n; i++) {
+		check("libtime_cpu_to_wall", values[i],
+		      (long double)values[i] * 1e6L / conv.cycles_per_msec,
+		      conv.clock_mult, conv.cycles_per_msec, libtime_cpu_to_wall(values[i]));
+		check("libtime_wall_to_cpu", values[i],
+		      (long double)values[i] * conv.cycles_per_msec / 1e6L,
+		      conv.cycles_mult, conv.cycles_per_msec, libtime_wall_to_cpu(values[i]));
+	}
+
+	/* Every batch kernel must agree with the scalar conversion exactly */
+	for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+		if (libtime_batch_set_kernel(kernels[k].kernel)) {
+			printf("%s batch kernel not supported, skipped\n", kernels[k].name);
+			continue;
+		}
+		printf("checking %s batch kernel\n", kernels[k].name);
+		libtime_cpu_to_wall_batch(values, batch, n);
+		for (i = 0; i < n; i++)
+			if (batch[i] != libtime_cpu_to_wall(values[i]) && failures++ < 10)
+				printf("%s libtime_cpu_to_wall_batch(%" PRIu64 ") = %" PRIu64 "\n",
+				       kernels[k].name, values[i], batch[i]);
+		libtime_wall_to_cpu_batch(values, batch, n);
+		for (i = 0; i < n; i++)
+			if (batch[i] != libtime_wall_to_cpu(values[i]) && failures++ < 10)
+				printf("%s libtime_wall_to_cpu_batch(%" PRIu64 ") = %" PRIu64 "\n",
+				       kernels[k].name, values[i], batch[i]);
+	}
+	libtime_batch_set_kernel(LIBTIME_BATCH_AUTO);
+
+	/* Round trips lose at most the cycles in one truncated nanosecond */
+	slack = conv.cycles_per_msec / 1000000 + 2;
+	for (i = 0; i < n; i++) {
+		x = values[i] >> 2;
+		y = libtime_wall_to_cpu(libtime_cpu_to_wall(x));
+		if ((y > x ? y - x : x - y) > slack + (x >> 60) && failures++ < 10)
+			printf("round trip %" PRIu64 " -> %" PRIu64 "\n", x, y);
+	}
+
+	printf("%zu values, %d failures\n", n, failures);
+
+	free(values);
+	free(batch);
+
+	return failures ? 1 : 0;
+}
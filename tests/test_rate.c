@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libtime.h>
+#include "libtime_internal.h"
+#include <inttypes.h>
+
+/* How far the published rate may be from one measured over RATE_NS */
+#define RATE_NS 200000000ULL
+#define MAX_PPM 500.0
+
+struct decode_case {
+	const char *name;
+	uint32_t leaf15[4];
+	uint32_t leaf16_eax;
+	uint64_t cycles;
+	uint64_t nsecs;
+	int exact;
+};
+
+static const struct decode_case decode_cases[] = {
+	/* 24MHz crystal, 176/2 ratio */
+	{ "crystal known", { 2, 176, 24000000, 0 }, 2100, 4224000000ULL, 2000000000ULL, 1 },
+	/* 25MHz crystal, 254/3 ratio: 2116666666.67Hz, not a whole number */
+	{ "uneven ratio", { 3, 254, 25000000, 0 }, 2100, 6350000000ULL, 3000000000ULL, 1 },
+	/* Skylake client: ratio but no crystal, so only the base frequency */
+	{ "crystal unknown", { 2, 216, 0, 0 }, 2600, 2600000000ULL, 1000000000ULL, 0 },
+	{ "leaf 0x16 only", { 0, 0, 0, 0 }, 3000, 3000000000ULL, 1000000000ULL, 0 },
+	{ "nothing", { 0, 0, 0, 0 }, 0, 0, 0, 0 },
+};
+
+static const struct {
+	const char *name;
+	unsigned int flags;
+} init_cases[] = {
+	{ "default", 0 },
+	{ "LIBTIME_INIT_VERIFY", LIBTIME_INIT_VERIFY },
+	{ "LIBTIME_INIT_CALIBRATE", LIBTIME_INIT_CALIBRATE },
+	{ "LIBTIME_INIT_ASYNC", LIBTIME_INIT_ASYNC },
+};
+
+/* Error of the published rate against the wall clock, in ppm */
+static double rate_error(void)
+{
+	uint64_t w_s, w_e, c_s, c_e;
+
+	w_s = libtime_wall();
+	c_s = libtime_cpu();
+	usleep(RATE_NS / 1000);
+	c_e = libtime_cpu();
+	w_e = libtime_wall();
+
+	return ((double)libtime_cpu_to_wall(c_e - c_s) - (double)(w_e - w_s)) * 1e6 / (double)(w_e - w_s);
+}
+
+int main(int argc, char **argv)
+{
+	const struct decode_case *d;
+	uint64_t cycles, nsecs;
+	double ppm;
+	size_t i;
+	int failures = 0, exact;
+
+	for (i = 0; i < sizeof(decode_cases) / sizeof(decode_cases[0]); i++) {
+		d = &decode_cases[i];
+		exact = libtime_cpuid_tsc_rate(d->leaf15, d->leaf16_eax, &cycles, &nsecs);
+		printf("cpuid %-18s %10" PRIu64 " cycles per %10" PRIu64 " ns, %s\n", d->name,
+		       cycles, nsecs, exact ? "exact" : "approximate");
+		if (cycles != d->cycles || nsecs != d->nsecs || exact != d->exact) {
+			printf("  expected %" PRIu64 " per %" PRIu64 ", %s\n", d->cycles, d->nsecs,
+			       d->exact ? "exact" : "approximate");
+			failures++;
+		}
+	}
+
+	exact = libtime_cpuid_tsc_rate(NULL, 2600, &cycles, &nsecs);
+	if (cycles != 2600000000ULL || nsecs != 1000000000ULL || exact) {
+		printf("cpuid without leaf 0x15 misdecoded\n");
+		failures++;
+	}
+
+	for (i = 0; i < sizeof(init_cases) / sizeof(init_cases[0]); i++) {
+		libtime_init_flags(init_cases[i].flags);
+		libtime_init_wait();
+		ppm = rate_error();
+		printf("%-24s rate error %8.1f ppm\n", init_cases[i].name, ppm);
+		if (ppm > MAX_PPM || ppm < -MAX_PPM)
+			failures++;
+	}
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <libtime.h>
+#include <inttypes.h>
+
+#define NR_SLEEPS 200
+#define SLEEP_NS 100000
+#define NR_PERIODS 100
+#define PERIOD_NS 250000
+
+static const char *mode_names[] = {
+	"SPIN_AUTO",
+	"SPIN_BUSY",
+	"SPIN_PAUSE",
+	"SPIN_TPAUSE",
+};
+
+int main(int argc, char **argv)
+{
+	struct libtime_spin_stats stats;
+	struct libtime_sleep_info info;
+	uint64_t s, e, elapsed, over, start, deadline, now;
+	int mode, i, early = 0;
+
+	libtime_init();
+
+	printf("%-12s %12s %12s %12s %12s\n", "mode", "over (ns)", "spins", "spin (ns)", "late (ns)");
+	for (mode = SPIN_AUTO; mode <= SPIN_TPAUSE; mode++) {
+		libtime_set_spin((SpinMode)mode, 0);
+		libtime_spin_stats(&stats, 1);
+
+		over = 0;
+		for (i = 0; i < NR_SLEEPS; i++) {
+			s = libtime_cpu();
+			libtime_nanosleep(SLEEP_NS);
+			e = libtime_cpu();
+			elapsed = libtime_cpu_to_wall(e - s);
+			if (elapsed < SLEEP_NS)
+				early++;
+			else
+				over += elapsed - SLEEP_NS;
+		}
+
+		libtime_spin_stats(&stats, 1);
+		printf("%-12s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+		       mode_names[mode], over / NR_SLEEPS, stats.spins,
+		       stats.spins ? stats.spin_ns / stats.spins : 0,
+		       stats.spins ? stats.late_ns / stats.spins : 0);
+	}
+
+	/* Periodic loop paced by absolute deadlines, with some work in each */
+	libtime_set_spin(SPIN_AUTO, 0);
+	over = 0;
+	start = libtime_read(CLOCK_WALL);
+	for (i = 1; i <= NR_PERIODS; i++) {
+		libtime_nanosleep(PERIOD_NS / 3);
+		deadline = start + (uint64_t)i * PERIOD_NS;
+		libtime_sleep_until(deadline, CLOCK_WALL);
+		now = libtime_read(CLOCK_WALL);
+		if (now < deadline)
+			early++;
+		else
+			over += now - deadline;
+	}
+	printf("libtime_sleep_until: %" PRIu64 " ns mean overshoot, %" PRIu64 " ns total drift\n",
+	       over / NR_PERIODS, libtime_read(CLOCK_WALL) - (start + NR_PERIODS * PERIOD_NS));
+
+	/* Same again with the adaptive sleep model */
+	printf("margin: %" PRIu64 " ns fixed", libtime_sleep_margin());
+	libtime_sleep_adaptive(1);
+	libtime_spin_stats(&stats, 1);
+	over = 0;
+	for (i = 0; i < NR_SLEEPS; i++) {
+		s = libtime_cpu();
+		libtime_nanosleep(SLEEP_NS);
+		e = libtime_cpu();
+		elapsed = libtime_cpu_to_wall(e - s);
+		if (elapsed < SLEEP_NS)
+			early++;
+		else
+			over += elapsed - SLEEP_NS;
+	}
+	libtime_spin_stats(&stats, 1);
+	printf(", %" PRIu64 " ns adaptive; %" PRIu64 " ns over, %" PRIu64 " ns spin per sleep\n",
+	       libtime_sleep_margin(), over / NR_SLEEPS, stats.spin_ns / NR_SLEEPS);
+	libtime_sleep_adaptive(0);
+
+	/* And with the lowest timer slack, where the system supports it */
+	libtime_sleep_info(&info);
+	printf("slack: %" PRId64 " ns, max sleep %" PRIu64 " ns", info.timer_slack_ns, info.max_sleep_ns);
+	if (!libtime_set_timer_slack(1)) {
+		libtime_sleep_info(&info);
+		libtime_spin_stats(&stats, 1);
+		over = 0;
+		for (i = 0; i < NR_SLEEPS; i++) {
+			s = libtime_cpu();
+			libtime_nanosleep(SLEEP_NS);
+			e = libtime_cpu();
+			elapsed = libtime_cpu_to_wall(e - s);
+			if (elapsed < SLEEP_NS)
+				early++;
+			else
+				over += elapsed - SLEEP_NS;
+		}
+		libtime_spin_stats(&stats, 1);
+		printf("; %" PRId64 " ns, max sleep %" PRIu64 " ns; %" PRIu64 " ns over, %" PRIu64 " ns spin per sleep",
+		       info.timer_slack_ns, info.max_sleep_ns, over / NR_SLEEPS, stats.spin_ns / NR_SLEEPS);
+		libtime_set_timer_slack(0);
+	}
+	printf("\n");
+
+	printf("early wakeups: %d\n", early);
+
+	return early ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <libtime.h>
+#include <libtime_ticker.h>
+#include <inttypes.h>
+
+#define PERIOD_NS 1000000
+#define NR_TICKS 100
+#define STALL_AT 50
+#define STALL_PERIODS 3
+
+static const char *policy_names[] = {
+	"TICKER_BURST",
+	"TICKER_SKIP",
+	"TICKER_RESET",
+};
+
+/*
+ * Put the ticker half a period past STALL_PERIODS more ticks than the one
+ * that's due, as though the caller had stalled, and wait for the late tick.
+ * The half period is the slack for getting from here to the ticker's own
+ * clock read.
+ */
+static uint64_t stall(struct libtime_ticker *t, uint64_t *before, uint64_t *after)
+{
+	uint64_t missed;
+
+	*before = libtime_cpu();
+	t->next = *before - STALL_PERIODS * t->period - t->period / 2;
+	missed = libtime_ticker_wait(t);
+	*after = libtime_cpu();
+	return missed;
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_ticker ticker;
+	struct libtime_ticker_stats stats;
+	uint64_t missed, dropped, before, after;
+	int policy, i, b, failures = 0, ok;
+
+	libtime_init();
+
+	for (policy = TICKER_BURST; policy <= TICKER_RESET; policy++) {
+		libtime_ticker_init(&ticker, PERIOD_NS, (TickerPolicy)policy);
+		for (i = 0; i < STALL_AT; i++)
+			libtime_ticker_wait(&ticker);
+		libtime_ticker_stats(&ticker, &stats);
+		dropped = stats.missed;
+
+		missed = stall(&ticker, &before, &after);
+		ok = 1;
+		switch (policy) {
+		case TICKER_BURST:
+			/* Each overdue tick comes back in turn, counting down */
+			for (i = STALL_PERIODS; i > 0; i--) {
+				if (missed != (uint64_t)i)
+					ok = 0;
+				missed = libtime_ticker_wait(&ticker);
+			}
+			libtime_ticker_stats(&ticker, &stats);
+			ok = ok && missed == 0 && stats.missed == dropped;
+			break;
+		case TICKER_SKIP:
+			libtime_ticker_stats(&ticker, &stats);
+			ok = missed == STALL_PERIODS + 1 && stats.missed - dropped == missed;
+			break;
+		case TICKER_RESET:
+			libtime_ticker_stats(&ticker, &stats);
+			ok = missed == STALL_PERIODS && stats.missed - dropped == missed &&
+			     ticker.next >= before + ticker.period && ticker.next <= after + ticker.period;
+			break;
+		}
+		if (!ok) {
+			printf("%s: stall of %d periods misreported (returned %" PRIu64 ", "
+			       "%" PRIu64 " dropped)\n", policy_names[policy], STALL_PERIODS,
+			       missed, stats.missed - dropped);
+			failures++;
+		}
+
+		i = STALL_AT + 1 + (policy == TICKER_BURST ? STALL_PERIODS : 0);
+		for (; i < NR_TICKS; i++)
+			libtime_ticker_wait(&ticker);
+		libtime_ticker_stats(&ticker, &stats);
+
+		printf("%s: %" PRIu64 " dropped, %" PRIu64 " early, %" PRIu64 " late\n",
+		       policy_names[policy], stats.missed, stats.early, stats.late);
+		printf("  error (ns): min %" PRId64 ", mean %" PRId64 ", max %" PRId64 "\n",
+		       stats.min_error_ns, stats.mean_error_ns, stats.max_error_ns);
+		printf("  late:");
+		for (b = 0; b < LIBTIME_TICKER_BUCKETS; b++)
+			printf(" %" PRIu64, stats.late_hist[b]);
+		printf("\n");
+
+		if (stats.ticks != NR_TICKS)
+			failures++;
+	}
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
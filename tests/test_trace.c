@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libtime.h>
+#include <libtime_trace.h>
+#include <inttypes.h>
+#include "test_common.h"
+
+#define NR_EVENTS 1000
+#define NR_STREAM 1000000
+#define MAX_SKEW_NS 50000
+
+struct sink {
+	char *data;
+	size_t len;
+	size_t max_chunk;
+	size_t chunks;
+};
+
+static int sink_write(void *arg, const void *data, size_t len)
+{
+	struct sink *s = arg;
+
+	if (len > s->max_chunk)
+		s->max_chunk = len;
+	s->chunks++;
+	if (s->data)
+		memcpy(s->data + s->len, data, len);
+	s->len += len;
+	return 0;
+}
+
+static uint64_t get_varint(const uint8_t **p)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (**p & 0x80) {
+		v |= (uint64_t)(**p & 0x7f) << shift;
+		shift += 7;
+		(*p)++;
+	}
+	v |= (uint64_t)*(*p)++ << shift;
+	return v;
+}
+
+/* The Perfetto clock expected for libtime_wall() */
+static uint64_t wall_clock_id;
+
+struct perfetto_counts {
+	uint64_t begins, ends, tracks, first_ts;
+	int clock_ok;
+};
+
+/* Walk the TracePackets, looking inside track events for their type. */
+static int parse_perfetto(const uint8_t *p, const uint8_t *end, struct perfetto_counts *c)
+{
+	const uint8_t *pkt, *pkt_end, *ev, *ev_end;
+	uint64_t key, len, ts, v;
+
+	memset(c, 0, sizeof(*c));
+	while (p < end) {
+		if (get_varint(&p) != ((1 << 3) | 2))
+			return 1;
+		len = get_varint(&p);
+		pkt = p;
+		pkt_end = p + len;
+		p = pkt_end;
+		ts = 0;
+		while (pkt < pkt_end) {
+			key = get_varint(&pkt);
+			if ((key & 7) == 0) {
+				v = get_varint(&pkt);
+				if (key >> 3 == 8)
+					ts = v;
+				if (key >> 3 == 58 && v == wall_clock_id)
+					c->clock_ok = 1;
+				continue;
+			}
+			if ((key & 7) != 2)
+				return 1;
+			len = get_varint(&pkt);
+			if (key >> 3 == 60)
+				c->tracks++;
+			if (key >> 3 == 11) {
+				ev = pkt;
+				ev_end = pkt + len;
+				while (ev < ev_end) {
+					key = get_varint(&ev);
+					if ((key & 7) == 2) {
+						ev += get_varint(&ev);
+						continue;
+					}
+					v = get_varint(&ev);
+					if (key >> 3 == 9 && v == 1) {
+						if (!c->first_ts)
+							c->first_ts = ts;
+						c->begins++;
+					}
+					if (key >> 3 == 9 && v == 2)
+						c->ends++;
+				}
+			}
+			pkt += len;
+		}
+	}
+	return 0;
+}
+
+static size_t count(const char *haystack, const char *needle)
+{
+	size_t n = 0;
+	while ((haystack = strstr(haystack, needle))) {
+		n++;
+		haystack++;
+	}
+	return n;
+}
+
+static uint64_t skew(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_trace_event *events;
+	struct libtime_trace *t;
+	struct perfetto_counts pc;
+	struct sink sink;
+	uint64_t first_wall, us;
+	unsigned int frac;
+	const char *ts, *name;
+	int i;
+
+	libtime_init();
+
+	name = libtime_clock_info(CLOCK_WALL)->name;
+	if (!strcmp(name, "CLOCK_REALTIME"))
+		wall_clock_id = 1;
+	else if (!strcmp(name, "CLOCK_MONOTONIC_COARSE"))
+		wall_clock_id = 4;
+	else
+		wall_clock_id = 3;
+
+	events = malloc(NR_EVENTS * sizeof(*events));
+	first_wall = libtime_wall();
+	for (i = 0; i < NR_EVENTS; i++) {
+		events[i].name = (i & 1) ? "odd" : "an \"even\"\tone";
+		events[i].tid = 1000 + (i & 3);
+		events[i].start = libtime_cpu();
+		events[i].end = events[i].start + 1000;
+	}
+
+	/* Chrome JSON */
+	memset(&sink, 0, sizeof(sink));
+	sink.data = malloc(1 << 20);
+	t = libtime_trace_open(TRACE_JSON, sink_write, &sink);
+	CHECK(libtime_trace_thread_name(t, 1000, "main") == 0);
+	CHECK(libtime_trace_write(t, events, NR_EVENTS) == 0);
+	for (i = 0; i < 10; i++) {
+		LIBTIME_ZONE("zone");
+	}
+	libtime_zone_collect(libtime_trace_zones, t);
+	CHECK(libtime_trace_close(t) == 0);
+	sink.data[sink.len] = 0;
+
+	CHECK(!strncmp(sink.data, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39));
+	CHECK(!strcmp(sink.data + sink.len - 4, "\n]}\n"));
+	CHECK(count(sink.data, "\"ph\":\"X\"") == NR_EVENTS + 10);
+	CHECK(count(sink.data, "\"name\":\"an \\\"even\\\"\\u0009one\"") == NR_EVENTS / 2);
+	CHECK(count(sink.data, "\"name\":\"zone\"") == 10);
+	CHECK(count(sink.data, "\"thread_name\"") == 1);
+	ts = strstr(sink.data, "\"ts\":");
+	CHECK(ts && sscanf(ts, "\"ts\":%" SCNu64 ".%u", &us, &frac) == 2);
+	printf("json: %zu bytes, first event %" PRId64 " ns from libtime_wall()\n",
+	       sink.len, (int64_t)(us * 1000 + frac - first_wall));
+	CHECK(skew(us * 1000 + frac, first_wall) < MAX_SKEW_NS);
+
+	/* Perfetto */
+	memset(sink.data, 0, 1 << 20);
+	sink.len = 0;
+	t = libtime_trace_open(TRACE_PERFETTO, sink_write, &sink);
+	CHECK(libtime_trace_thread_name(t, 1000, "main") == 0);
+	CHECK(libtime_trace_write(t, events, NR_EVENTS) == 0);
+	CHECK(libtime_trace_close(t) == 0);
+	CHECK(parse_perfetto((uint8_t *)sink.data, (uint8_t *)sink.data + sink.len, &pc) == 0);
+	printf("perfetto: %zu bytes, %" PRIu64 " tracks, %" PRIu64 " begins, %" PRIu64 " ends, "
+	       "first event %" PRId64 " ns from libtime_wall()\n", sink.len, pc.tracks, pc.begins,
+	       pc.ends, (int64_t)(pc.first_ts - first_wall));
+	CHECK(pc.clock_ok);
+	CHECK(pc.tracks == 5);
+	CHECK(pc.begins == NR_EVENTS && pc.ends == NR_EVENTS);
+	CHECK(skew(pc.first_ts, first_wall) < MAX_SKEW_NS);
+	free(sink.data);
+
+	/* A long capture goes out in pieces no bigger than the buffer */
+	memset(&sink, 0, sizeof(sink));
+	t = libtime_trace_open(TRACE_JSON, sink_write, &sink);
+	for (i = 0; i < NR_STREAM / NR_EVENTS; i++)
+		libtime_trace_write(t, events, NR_EVENTS);
+	CHECK(libtime_trace_close(t) == 0);
+	printf("stream: %zu bytes in %zu writes of at most %zu\n", sink.len, sink.chunks, sink.max_chunk);
+	CHECK(sink.max_chunk <= 65536);
+
+	free(events);
+
+	printf("%d failures\n", failures);
+	return failures ? 1 : 0;
+}
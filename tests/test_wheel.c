@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <libtime.h>
+#include <libtime_wheel.h>
+#include <inttypes.h>
+
+#define NR_TIMERS 200000
+#define RESOLUTION_NS 100000
+
+struct entry {
+	struct libtime_timer *timer;
+	uint64_t deadline;
+	uint64_t fired;
+	int cancelled;
+};
+
+static uint64_t now, prev_now;
+static int early, late;
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void fire(void *arg)
+{
+	struct entry *e = arg;
+
+	e->fired = now;
+	e->timer = NULL;
+	if (now < e->deadline)
+		early++;
+	/* It should have fired at the first expiry at least one unit past it */
+	if (prev_now > e->deadline + 2 * libtime_wall_to_cpu(RESOLUTION_NS))
+		late++;
+}
+
+int main(int argc, char **argv)
+{
+	struct libtime_wheel *w;
+	struct entry *entries;
+	uint64_t state = 0x2545f4914f6cdd1dULL, base, s, e;
+	size_t i, fired = 0, expected = 0, lost = 0;
+	int64_t ns;
+
+	libtime_init();
+
+	w = libtime_wheel_create(RESOLUTION_NS);
+	entries = calloc(NR_TIMERS, sizeof(*entries));
+	if (!w || !entries)
+		return 1;
+
+	/*
+	 * Simulated time: deadlines from now out to a couple of days of CPU
+	 * clock, with the clock advanced in random steps of up to ~40 bits.
+	 */
+	base = now = prev_now = libtime_cpu();
+	s = libtime_cpu();
+	for (i = 0; i < NR_TIMERS; i++) {
+		entries[i].deadline = base + (xorshift64(&state) >> (20 + (xorshift64(&state) % 44)));
+		entries[i].timer = libtime_wheel_add_at(w, entries[i].deadline, fire, &entries[i]);
+	}
+	for (i = 0; i < NR_TIMERS; i += 3) {
+		libtime_wheel_cancel(w, entries[i].timer);
+		entries[i].timer = NULL;
+		entries[i].cancelled = 1;
+	}
+	e = libtime_cpu();
+	printf("add/cancel: %.1f ns per timer\n",
+	       (double)libtime_cpu_to_wall(e - s) / (NR_TIMERS + NR_TIMERS / 3));
+
+	s = libtime_cpu();
+	while (libtime_wheel_next(w) != UINT64_MAX) {
+		prev_now = now;
+		now += xorshift64(&state) >> (24 + (xorshift64(&state) % 40));
+		fired += libtime_wheel_expire(w, now);
+	}
+	e = libtime_cpu();
+	printf("expire: %.1f ns per timer\n", (double)libtime_cpu_to_wall(e - s) / fired);
+
+	for (i = 0; i < NR_TIMERS; i++) {
+		if (!entries[i].cancelled)
+			expected++;
+		if (!entries[i].cancelled && !entries[i].fired)
+			lost++;
+	}
+	printf("%zu fired, %zu expected, %zu lost, %d early, %d late\n",
+	       fired, expected, lost, early, late);
+
+	/*
+	 * Real time, on a new wheel since the simulated clock has run ahead: a
+	 * few short timeouts driven by the next expiry query.
+	 */
+	libtime_wheel_destroy(w);
+	w = libtime_wheel_create(RESOLUTION_NS);
+	if (!w)
+		return 1;
+	now = libtime_cpu();
+	for (i = 0; i < 10; i++) {
+		entries[i].deadline = libtime_cpu() + libtime_wall_to_cpu((i + 1) * 1000000ULL);
+		entries[i].fired = 0;
+		libtime_wheel_add_at(w, entries[i].deadline, fire, &entries[i]);
+	}
+	while ((ns = libtime_wheel_next_ns(w, libtime_cpu())) >= 0) {
+		libtime_nanosleep(ns);
+		prev_now = now;
+		now = libtime_cpu();
+		fired += libtime_wheel_expire(w, now);
+	}
+	for (i = 0; i < 10; i++)
+		printf("timer %zu: %" PRIu64 " ns late\n", i,
+		       libtime_cpu_to_wall(entries[i].fired - entries[i].deadline));
+
+	libtime_wheel_destroy(w);
+	free(entries);
+
+	return (fired != expected + 10 || lost || early || late) ? 1 : 0;
+}
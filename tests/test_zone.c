@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libtime.h>
+#include <libtime_zone.h>
+#include <inttypes.h>
+
+#define NR_THREADS 4
+#define NR_ITERS 100000
+#define NR_BATCH 4000
+#define NR_RUNS 100
+
+struct counts {
+	uint64_t outer, inner, bad;
+	uint64_t threads[NR_THREADS];
+	int nr_threads;
+};
+
+static volatile int workers_done;
+static volatile uint64_t sink;
+
+static void count_zones(void *arg, const struct libtime_zone_record *records, size_t n)
+{
+	struct counts *c = arg;
+	size_t i;
+	int t;
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(records[i].site->name, "outer"))
+			c->outer++;
+		else if (!strcmp(records[i].site->name, "inner"))
+			c->inner++;
+		if (records[i].duration_ns > 1000000000ULL)
+			c->bad++;
+
+		for (t = 0; t < c->nr_threads; t++)
+			if (c->threads[t] == records[i].thread_id)
+				break;
+		if (t == c->nr_threads && t < NR_THREADS)
+			c->threads[c->nr_threads++] = records[i].thread_id;
+	}
+}
+
+static void *worker(void *arg)
+{
+	int i, j;
+
+	for (i = 0; i < NR_ITERS; i++) {
+		LIBTIME_ZONE("outer");
+		for (j = 0; j < 10; j++)
+			sink += j;
+		{
+			LIBTIME_ZONE("inner");
+			sink += i;
+		}
+	}
+	return NULL;
+}
+
+static void ignore_zones(void *arg, const struct libtime_zone_record *records, size_t n)
+{
+}
+
+static void empty_zones(int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		LIBTIME_ZONE("empty");
+		__asm__ __volatile__("" ::: "memory");
+	}
+}
+
+static void empty_loop(int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		__asm__ __volatile__("" ::: "memory");
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[NR_THREADS];
+	struct counts c;
+	uint64_t s, e, best = UINT64_MAX, best_loop = UINT64_MAX, dropped;
+	int i, failures = 0;
+
+	libtime_init();
+	memset(&c, 0, sizeof(c));
+
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+
+	/* Collect while they run, as a collector thread would */
+	for (i = 0; i < NR_THREADS * 20; i++) {
+		libtime_zone_collect(count_zones, &c);
+		libtime_nanosleep(100000);
+	}
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	libtime_zone_collect(count_zones, &c);
+
+	dropped = libtime_zone_dropped();
+	printf("collected %" PRIu64 " outer, %" PRIu64 " inner from %d threads, %" PRIu64 " dropped\n",
+	       c.outer, c.inner, c.nr_threads, dropped);
+	if (c.outer + c.inner + dropped != 2ULL * NR_THREADS * NR_ITERS) {
+		printf("FAIL: zones lost\n");
+		failures++;
+	}
+	if (c.nr_threads != NR_THREADS || c.bad) {
+		printf("FAIL: bad records\n");
+		failures++;
+	}
+
+	/* The exited threads' rings are gone, so there's nothing left */
+	memset(&c, 0, sizeof(c));
+	if (libtime_zone_collect(count_zones, &c) || libtime_zone_dropped() != dropped) {
+		printf("FAIL: rings not retired\n");
+		failures++;
+	}
+
+	/* Cost of one zone, emptying the ring between runs so none drop */
+	for (i = 0; i < NR_RUNS; i++) {
+		s = libtime_cpu();
+		empty_zones(NR_BATCH);
+		e = libtime_cpu();
+		if (e - s < best)
+			best = e - s;
+		libtime_zone_collect(ignore_zones, NULL);
+
+		s = libtime_cpu();
+		empty_loop(NR_BATCH);
+		e = libtime_cpu();
+		if (e - s < best_loop)
+			best_loop = e - s;
+	}
+	printf("zone overhead: %.1f ns\n",
+	       (double)libtime_cpu_to_wall(best - best_loop) / NR_BATCH);
+	if (libtime_zone_dropped() != dropped) {
+		printf("FAIL: zones dropped in overhead test\n");
+		failures++;
+	}
+
+	return failures ? 1 : 0;
+}